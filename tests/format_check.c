@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* const formatUsageError =
+    "Usage: ./format_check sigfigures valuesfile\n";
+const char* const formatFileError =
+    "format_check: unable to read values from \"%s\"\n";
+
+#define USAGE_CODE 1
+#define FILE_CODE 2
+#define LINE_SIZE 256
+
+/**
+ * main()
+ * ----------------
+ * Prints each value in a file of numbers, one to a line, in the way uqexpr
+ *prints a result but formatted by printf("%.<sigfigures>g"), so that
+ *make check can compare uqexpr's own formatter with printf. Blank lines and
+ *lines starting with '#' are skipped, as uqexpr skips them.
+ *
+ * argc: The number of arguments.
+ * argv: The program name, the number of significant figures and the file.
+ *
+ * Returns: 0 on success.
+ *
+ * Errors: If the arguments are wrong, prints a usage error and exits with
+ *code 1. If the file cannot be read, prints an error and exits with code 2.
+ *
+ **/
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fputs(formatUsageError, stderr);
+    return USAGE_CODE;
+  }
+  const int sigFigures = atoi(argv[1]);
+  FILE* file = fopen(argv[2], "r");
+  if (file == NULL) {
+    fprintf(stderr, formatFileError, argv[2]);
+    return FILE_CODE;
+  }
+
+  char line[LINE_SIZE];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    printf("Result = %.*g\n", sigFigures, strtod(line, NULL));
+  }
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,632 @@
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+const char* const linesOption = "--lines";
+const char* const runsOption = "--runs";
+const char* const samplesOption = "--samples";
+const char* const argOption = "--arg";
+const char* const benchUsageError =
+    "Usage: ./uqbench [--lines n] [--runs n] [--samples n] [--arg option]... "
+    "uqexprpath\n";
+const char* const workDirError = "uqbench: unable to create work directory\n";
+const char* const workloadError = "uqbench: unable to write workload \"%s\"\n";
+const char* const runError = "uqbench: unable to run \"%s\"\n";
+const char* const latencyError =
+    "uqbench: \"%s\" stopped responding during latency run\n";
+const char* const readyMessage = "Submit your expressions";
+const char* const workDirTemplate = "/tmp/uqbench.XXXXXX";
+const char* const tableHeader = "%-12s %9s %12s %9s %9s %9s %9s %10s\n";
+const char* const tableRow = "%-12s %9d %12.0f %9.1f %9.1f %9.1f %9.1f %10ld\n";
+
+#define USAGE_CODE 1
+#define WORK_DIR_CODE 2
+#define WORKLOAD_CODE 3
+#define RUN_CODE 4
+#define EXEC_FAILED_CODE 127
+#define DEFAULT_LINES 200000
+#define DEFAULT_RUNS 3
+#define DEFAULT_SAMPLES 2000
+#define BENCH_ARGS_MAX 32
+#define PATH_SIZE 256
+#define RESPONSE_SIZE 4096
+#define NAME_SIZE 16
+#define LETTER_COUNT 26
+#define CHAIN_VARIABLES 64
+#define WIDE_VARIABLES 20000
+#define LONG_LINE_TERMS 400
+#define NANOSECONDS_PER_SECOND 1e9
+#define NANOSECONDS_PER_MICROSECOND 1e3
+#define PERCENTILE_50 0.50
+#define PERCENTILE_90 0.90
+#define PERCENTILE_99 0.99
+
+// Settings for one benchmark session
+typedef struct {
+  const char* program;
+  int lines;
+  int runs;
+  int samples;
+  const char* args[BENCH_ARGS_MAX];
+  int argCount;
+} BenchOptions;
+
+// A synthetic input: every generated line makes uqexpr print exactly one line
+typedef struct {
+  const char* name;
+  void (*generate)(FILE* file, int index, int lines);
+} Workload;
+
+// Measurements for one workload
+typedef struct {
+  double linesPerSecond;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+  long maxRss;
+} BenchResult;
+
+/**
+ * variable_name()
+ * ----------------
+ * Writes a distinct, purely alphabetic variable name for an index.
+ *
+ * name: Buffer of at least NAME_SIZE characters to write the name into.
+ * index: Non-negative index of the variable.
+ *
+ * Returns: void
+ *
+ **/
+void variable_name(char name[], int index) {
+  int length = 0;
+  name[length++] = 'v';
+  do {
+    name[length++] = (char)('a' + index % LETTER_COUNT);
+    index /= LETTER_COUNT;
+  } while (index > 0);
+  name[length] = '\0';
+}
+
+/**
+ * generate_expressions()
+ * ----------------
+ * Writes an expression-heavy line built only from numbers and builtins, so
+ *nearly every line is a distinct expression to compile and evaluate.
+ *
+ * file: File to write the line to.
+ * index: Index of the line within the workload.
+ * lines: Total number of lines in the workload.
+ *
+ * Returns: void
+ *
+ **/
+void generate_expressions(FILE* file, int index, int lines) {
+  (void)lines;
+  fprintf(file, "(%d.%d + %d) * sin(%d) - sqrt(%d) / 7\n", index % 1000,
+          index % 7, index % 13, index % 360, index % 9973);
+}
+
+/**
+ * generate_assignments()
+ * ----------------
+ * Writes an assignment-heavy line that updates a small set of variables from
+ *each other, after first giving each of them an initial value.
+ *
+ * file: File to write the line to.
+ * index: Index of the line within the workload.
+ * lines: Total number of lines in the workload.
+ *
+ * Returns: void
+ *
+ **/
+void generate_assignments(FILE* file, int index, int lines) {
+  (void)lines;
+  char target[NAME_SIZE];
+  char source[NAME_SIZE];
+  variable_name(target, index % CHAIN_VARIABLES);
+  if (index < CHAIN_VARIABLES) {
+    fprintf(file, "%s = %d\n", target, index);
+    return;
+  }
+  variable_name(source, (index * 7 + 3) % CHAIN_VARIABLES);
+  fprintf(file, "%s = %s * 0.5 + %s / 3\n", target, target, source);
+}
+
+/**
+ * generate_variables()
+ * ----------------
+ * Writes a line of the large-variable-count workload: the first part of the
+ *file defines many distinct variables and the rest reads them back.
+ *
+ * file: File to write the line to.
+ * index: Index of the line within the workload.
+ * lines: Total number of lines in the workload.
+ *
+ * Returns: void
+ *
+ **/
+void generate_variables(FILE* file, int index, int lines) {
+  int count = lines / 2;
+  if (count > WIDE_VARIABLES) {
+    count = WIDE_VARIABLES;
+  }
+  if (count < 1) {
+    count = 1;
+  }
+  char first[NAME_SIZE];
+  char second[NAME_SIZE];
+  if (index < count) {
+    variable_name(first, index);
+    fprintf(file, "%s = %d.25\n", first, index);
+    return;
+  }
+  variable_name(first, (index * 31) % count);
+  variable_name(second, (index * 17 + 5) % count);
+  fprintf(file, "%s + %s * 2\n", first, second);
+}
+
+/**
+ * generate_long_lines()
+ * ----------------
+ * Writes one long expression made of many terms.
+ *
+ * file: File to write the line to.
+ * index: Index of the line within the workload.
+ * lines: Total number of lines in the workload.
+ *
+ * Returns: void
+ *
+ **/
+void generate_long_lines(FILE* file, int index, int lines) {
+  (void)lines;
+  for (int term = 0; term < LONG_LINE_TERMS; ++term) {
+    fprintf(file, "%s%d.5 * %d", term == 0 ? "" : " + ", (index + term) % 97,
+            term % 11);
+  }
+  fputc('\n', file);
+}
+
+const Workload workloads[] = {
+    {"expressions", generate_expressions},
+    {"assignments", generate_assignments},
+    {"variables", generate_variables},
+    {"long-lines", generate_long_lines},
+};
+
+/**
+ * elapsed_seconds()
+ * ----------------
+ * Calculates the time between two monotonic clock readings.
+ *
+ * start: The earlier reading.
+ * end: The later reading.
+ *
+ * Returns: The elapsed time in seconds.
+ *
+ **/
+double elapsed_seconds(const struct timespec* start,
+                       const struct timespec* end) {
+  return (double)(end->tv_sec - start->tv_sec) +
+         (double)(end->tv_nsec - start->tv_nsec) / NANOSECONDS_PER_SECOND;
+}
+
+/**
+ * write_workload()
+ * ----------------
+ * Generates a workload into a file.
+ *
+ * path: Path of the file to create.
+ * workload: The workload to generate.
+ * lines: Number of lines to write.
+ *
+ * Returns: 0 on success, or WORKLOAD_CODE after printing an error if the
+ *file cannot be written.
+ *
+ **/
+int write_workload(const char* path, const Workload* workload, int lines) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, workloadError, path);
+    return WORKLOAD_CODE;
+  }
+  for (int i = 0; i < lines; ++i) {
+    workload->generate(file, i, lines);
+  }
+  if (fclose(file) != 0) {
+    fprintf(stderr, workloadError, path);
+    return WORKLOAD_CODE;
+  }
+  return 0;
+}
+
+/**
+ * exec_program()
+ * ----------------
+ * Replaces the current (child) process with uqexpr, passing the extra
+ *options followed by an optional input file. If uqexpr cannot be started
+ *the child exits with EXEC_FAILED_CODE, which uqexpr itself never uses.
+ *
+ * options: The benchmark settings.
+ * path: Input file to pass, or NULL to have uqexpr read stdin.
+ *
+ * Returns: Does not return.
+ *
+ **/
+void exec_program(const BenchOptions* options, const char* path) {
+  const char* argv[BENCH_ARGS_MAX + 3];
+  int argc = 0;
+  argv[argc++] = options->program;
+  for (int i = 0; i < options->argCount; ++i) {
+    argv[argc++] = options->args[i];
+  }
+  if (path != NULL) {
+    argv[argc++] = path;
+  }
+  argv[argc] = NULL;
+  execv(options->program, (char* const*)argv);
+  _exit(EXEC_FAILED_CODE);
+}
+
+/**
+ * run_throughput()
+ * ----------------
+ * Runs uqexpr over a workload file with its output discarded, keeping the
+ *fastest run and the largest peak resident set size seen.
+ *
+ * options: The benchmark settings.
+ * path: The workload file.
+ * result: Where to store lines per second and peak RSS.
+ *
+ * Returns: 0 on success, or RUN_CODE after printing an error if uqexpr
+ *cannot be run or does not exit with status 0.
+ *
+ **/
+int run_throughput(const BenchOptions* options, const char* path,
+                    BenchResult* result) {
+  double best = 0.0;
+  result->maxRss = 0;
+  for (int run = 0; run < options->runs; ++run) {
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const pid_t pid = fork();
+    if (pid == 0) {
+      const int devNull = open("/dev/null", O_WRONLY);
+      dup2(devNull, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      close(devNull);
+      exec_program(options, path);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fprintf(stderr, runError, options->program);
+      return RUN_CODE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = elapsed_seconds(&start, &end);
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+    if (usage.ru_maxrss > result->maxRss) {
+      result->maxRss = usage.ru_maxrss;
+    }
+  }
+  result->linesPerSecond = (best > 0.0) ? options->lines / best : 0.0;
+  return 0;
+}
+
+/**
+ * read_response()
+ * ----------------
+ * Reads from the terminal until the text read contains a given number of
+ *line endings, or optionally a given marker.
+ *
+ * terminal: File descriptor of the pseudo-terminal master.
+ * lineCount: Number of line endings to wait for.
+ * marker: Text to wait for before counting line endings, or NULL.
+ *
+ * Returns: 1 if the response arrived, 0 if the program stopped first.
+ *
+ **/
+int read_response(int terminal, int lineCount, const char* marker) {
+  char response[RESPONSE_SIZE + 1];
+  size_t used = 0;
+  int seenMarker = (marker == NULL);
+  while (lineCount > 0) {
+    const ssize_t numRead =
+        read(terminal, response + used, RESPONSE_SIZE - used);
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      return 0;
+    }
+    response[used + numRead] = '\0';
+    for (ssize_t i = 0; i < numRead; ++i) {
+      if (seenMarker && response[used + i] == '\n') {
+        --lineCount;
+      }
+    }
+    used += numRead;
+    if (!seenMarker && strstr(response, marker) != NULL) {
+      // Count only the line endings after the marker
+      seenMarker = 1;
+      for (const char* next = strstr(response, marker); *next != '\0';
+           ++next) {
+        if (*next == '\n') {
+          --lineCount;
+        }
+      }
+    }
+    if (used == RESPONSE_SIZE) {
+      // Only line endings matter once the marker has been seen
+      used = 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * compare_doubles()
+ * ----------------
+ * Orders two doubles for qsort.
+ *
+ * first: Pointer to the first double.
+ * second: Pointer to the second double.
+ *
+ * Returns: Negative, zero or positive as first is below, equal to or above
+ *second.
+ *
+ **/
+int compare_doubles(const void* first, const void* second) {
+  const double a = *(const double*)first;
+  const double b = *(const double*)second;
+  return (a > b) - (a < b);
+}
+
+/**
+ * percentile()
+ * ----------------
+ * Picks a percentile from sorted samples by the nearest-rank method.
+ *
+ * samples: Sorted samples.
+ * count: Number of samples, at least one.
+ * fraction: Percentile to pick, between 0 and 1.
+ *
+ * Returns: The chosen sample.
+ *
+ **/
+double percentile(const double samples[], int count, double fraction) {
+  int rank = (int)(fraction * count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > count) {
+    rank = count;
+  }
+  return samples[rank - 1];
+}
+
+/**
+ * run_latency()
+ * ----------------
+ * Feeds the first lines of a workload to an interactive uqexpr one at a time
+ *and times how long each line takes to be answered. uqexpr's stdout is a
+ *pseudo-terminal so that it answers every line as soon as it is handled.
+ *
+ * options: The benchmark settings.
+ * path: The workload file.
+ * result: Where to store the latency percentiles in microseconds.
+ *
+ * Returns: 0 on success, or RUN_CODE after printing an error if uqexpr
+ *cannot be run or stops answering.
+ *
+ **/
+int run_latency(const BenchOptions* options, const char* path,
+                 BenchResult* result) {
+  const int terminal = posix_openpt(O_RDWR | O_NOCTTY);
+  int input[2];
+  if (terminal < 0 || grantpt(terminal) < 0 || unlockpt(terminal) < 0 ||
+      pipe(input) < 0) {
+    fprintf(stderr, runError, options->program);
+    if (terminal >= 0) {
+      close(terminal);
+    }
+    return RUN_CODE;
+  }
+  const pid_t pid = fork();
+  if (pid == 0) {
+    const int replica = open(ptsname(terminal), O_RDWR | O_NOCTTY);
+    struct termios settings;
+    if (replica >= 0 && tcgetattr(replica, &settings) == 0) {
+      cfmakeraw(&settings);
+      tcsetattr(replica, TCSANOW, &settings);
+    }
+    const int devNull = open("/dev/null", O_WRONLY);
+    dup2(input[0], STDIN_FILENO);
+    dup2(replica, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(input[0]);
+    close(input[1]);
+    close(replica);
+    close(devNull);
+    close(terminal);
+    exec_program(options, NULL);
+  }
+  close(input[0]);
+
+  FILE* file = fopen(path, "r");
+  double* samples = malloc(sizeof(double) * options->samples);
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  int count = 0;
+  int answered = (pid > 0 && file != NULL && samples != NULL &&
+                  read_response(terminal, 1, readyMessage));
+  while (answered && count < options->samples &&
+         (length = getline(&line, &capacity, file)) > 0) {
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    answered = (write(input[1], line, length) == length &&
+                read_response(terminal, 1, NULL));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    samples[count++] = elapsed_seconds(&start, &end) * NANOSECONDS_PER_SECOND /
+                       NANOSECONDS_PER_MICROSECOND;
+  }
+  close(input[1]);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+  close(terminal);
+  free(line);
+  if (file != NULL) {
+    fclose(file);
+  }
+  if (!answered || count == 0) {
+    fprintf(stderr, latencyError, options->program);
+    free(samples);
+    return RUN_CODE;
+  }
+
+  qsort(samples, count, sizeof(double), compare_doubles);
+  result->p50 = percentile(samples, count, PERCENTILE_50);
+  result->p90 = percentile(samples, count, PERCENTILE_90);
+  result->p99 = percentile(samples, count, PERCENTILE_99);
+  result->max = samples[count - 1];
+  free(samples);
+  return 0;
+}
+
+/**
+ * positive_number()
+ * ----------------
+ * Parses a strictly positive integer command line value.
+ *
+ * input: The text to parse, which may be NULL if the value is missing.
+ *
+ * Returns: The value, or 0 if it is not a positive integer.
+ *
+ **/
+int positive_number(const char* input) {
+  if (input == NULL || *input == '\0') {
+    return 0;
+  }
+  char* end;
+  errno = 0;
+  const long value = strtol(input, &end, 10);
+  if (*end != '\0' || errno != 0 || value < 1 || value > INT_MAX) {
+    return 0;
+  }
+  return (int)value;
+}
+
+/**
+ * parse_options()
+ * ----------------
+ * Reads the benchmark settings from the command line.
+ *
+ * argc: Number of command line arguments.
+ * argv: The command line arguments.
+ * options: Where to store the settings.
+ *
+ * Returns: void
+ *
+ * Errors: If the command line is invalid, prints the usage and exits.
+ *
+ **/
+void parse_options(int argc, char* argv[], BenchOptions* options) {
+  options->lines = DEFAULT_LINES;
+  options->runs = DEFAULT_RUNS;
+  options->samples = DEFAULT_SAMPLES;
+  options->argCount = 0;
+  int i = 1;
+  for (; i < argc - 1; i += 2) {
+    const char* value = argv[i + 1];
+    int* number = NULL;
+    if (strcmp(argv[i], linesOption) == 0) {
+      number = &options->lines;
+    } else if (strcmp(argv[i], runsOption) == 0) {
+      number = &options->runs;
+    } else if (strcmp(argv[i], samplesOption) == 0) {
+      number = &options->samples;
+    } else if (strcmp(argv[i], argOption) == 0 &&
+               options->argCount < BENCH_ARGS_MAX) {
+      options->args[options->argCount++] = value;
+      continue;
+    } else {
+      break;
+    }
+    if ((*number = positive_number(value)) == 0) {
+      break;
+    }
+  }
+  if (i != argc - 1) {
+    fputs(benchUsageError, stderr);
+    exit(USAGE_CODE);
+  }
+  options->program = argv[argc - 1];
+}
+
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+  parse_options(argc, argv, &options);
+
+  char workDir[PATH_SIZE];
+  strcpy(workDir, workDirTemplate);
+  if (mkdtemp(workDir) == NULL) {
+    fputs(workDirError, stderr);
+    return WORK_DIR_CODE;
+  }
+
+  printf(tableHeader, "workload", "lines", "lines/s", "p50 us", "p90 us",
+         "p99 us", "max us", "rss KiB");
+  fflush(stdout);
+  const int workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+  for (int i = 0; i < workloadCount; ++i) {
+    char path[PATH_SIZE];
+    const int pathLength = snprintf(path, sizeof(path), "%s/%s.txt", workDir,
+                                    workloads[i].name);
+    if (pathLength < 0 || pathLength >= (int)sizeof(path)) {
+      fprintf(stderr, workloadError, workloads[i].name);
+      rmdir(workDir);
+      return WORKLOAD_CODE;
+    }
+    BenchResult result;
+    int code = write_workload(path, &workloads[i], options.lines);
+    if (code == 0) {
+      code = run_throughput(&options, path, &result);
+    }
+    if (code == 0) {
+      code = run_latency(&options, path, &result);
+    }
+    if (code != 0) {
+      // Leave nothing behind in /tmp, even when a step fails
+      unlink(path);
+      rmdir(workDir);
+      return code;
+    }
+    printf(tableRow, workloads[i].name, options.lines, result.linesPerSecond,
+           result.p50, result.p90, result.p99, result.max, result.maxRss);
+    fflush(stdout);
+    unlink(path);
+  }
+  rmdir(workDir);
+
+  return 0;
+}
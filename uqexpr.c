@@ -1,22 +1,51 @@
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <tinyexpr.h>
 
 const char* const def = "--def";
 const char* const loop = "--forloop";
 const char* const sig = "--sigfigures";
+const char* const jobsOption = "--jobs";
+const char* const statsOption = "--stats";
+const char* const backendOption = "--backend";
+const char* const reactiveOption = "--reactive";
+const char* const serveOption = "--serve";
+const char* const stateOption = "--state";
+const char* const outputOption = "--output";
 const char* const usageError =
     "Usage: ./uqexpr [--sigfigures 2..9] [--forloop "
-    "string] [--def string] [inputfilename]\n";
+    "string] [--def string] [--jobs 1..64] [--stats] "
+    "[--backend tree|bytecode|jit] [--reactive] [--serve socket] "
+    "[--state file] [--output text|ndjson|binary] [inputfilename]\n";
 const char* const invalidVariablesError =
     "uqexpr: invalid variable(s) specified on the command line\n";
 const char* const duplicateNameError =
     "uqexpr: one or more variables are duplicated\n";
 const char* const fileReadError =
     "uqexpr: unable to read from input file \"%s\"\n";
+const char* const serveError = "uqexpr: unable to serve on socket \"%s\"\n";
+const char* const sessionError =
+    "uqexpr: unable to start a session on socket \"%s\"\n";
+const char* const stateError = "uqexpr: unable to use state file \"%s\"\n";
 const char* const noFileFound =
     "Submit your expressions and assignment "
     "operations to be evaluated.\n";
@@ -27,29 +56,186 @@ const char* const runningError =
     "Error in command, expression or assignment operation detected\n";
 const char* const print = "@print";
 const char* const range = "@range";
+const char* const save = "@save";
+const char* const load = "@load";
+const char* const csv = "@csv";
+const char* const binary = "@binary";
+const char* const stateMagic = "UQXS";
+const char* const stateTemporarySuffix = ".tmp";
+const char* const outputMagic = "UQXO";
 
 #define USAGE_CODE 12
 #define INVALID_VARIABLES_CODE 4
 #define DUPLICATE_NAME_CODE 18
 #define FILE_READ_CODE 19
+#define SERVE_CODE 20
+#define SERVE_BACKLOG 64
+#define SERVE_RETRY_DELAY_MS 100
+#define SERVE_UMASK 0077
+#define STATE_CODE 21
+#define STATE_MAGIC_SIZE 4
+#define STATE_VERSION 1u
+#define STATE_BYTE_ORDER 0x01020304u
+#define OUTPUT_MAGIC_SIZE 4
+#define OUTPUT_VERSION 1u
+#define OUTPUT_BYTE_ORDER 0x01020304u
 #define DEFAULT_SIG_FIGURES 3
 #define SIG_FIGURES_MIN 2
 #define SIG_FIGURES_MAX 9
 #define DEF_TOKEN_SIZE 3
 #define LOOP_TOKEN_SIZE 5
 #define LOOP_VARIABLE_SIZE 4
-#define ASSIGNMENT_TOKEN_SIZE 2
-#define BUFFER_SIZE 80
+#define READ_BLOCK_SIZE 65536
+#define EDITOR_LINE_SIZE 256
+#define EDITOR_HISTORY_MAX 1000
+#define EDITOR_ESCAPE_MAX 8
+#define EDITOR_EDITING 0
+#define EDITOR_ENTER 1
+#define EDITOR_END 2
+#define EDITOR_KEY_CTRL_A 1
+#define EDITOR_KEY_CTRL_B 2
+#define EDITOR_KEY_CTRL_C 3
+#define EDITOR_KEY_CTRL_D 4
+#define EDITOR_KEY_CTRL_E 5
+#define EDITOR_KEY_CTRL_F 6
+#define EDITOR_KEY_CTRL_H 8
+#define EDITOR_KEY_CTRL_K 11
+#define EDITOR_KEY_CTRL_L 12
+#define EDITOR_KEY_CTRL_N 14
+#define EDITOR_KEY_CTRL_P 16
+#define EDITOR_KEY_CTRL_U 21
+#define EDITOR_KEY_CTRL_W 23
+#define EDITOR_KEY_ESCAPE 27
+#define EDITOR_KEY_BACKSPACE 127
 #define VARIABLE_NAME_MIN 1
 #define VARIABLE_NAME_MAX 20
-#define DEF_FORMAT_SIZE 50
-#define LOOP_FORMAT_SIZE 100
-#define EXPRESSION_FORMAT_SIZE 20
 #define VARIABLE_NAME_SIZE 21
 #define START 1
 #define INCREMENT 2
 #define END 3
 #define LOOP_VALUES_SIZE 3
+#define EXPR_CACHE_BUCKETS 1024
+#define EXPR_CACHE_MAX_ENTRIES 4096
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define SYMBOL_TABLE_MIN_SIZE 64
+#define SESSION_ARENA_BLOCK_SIZE 4096
+#define LINE_ARENA_BLOCK_SIZE 65536
+#define CACHE_ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT 16
+#define ARRAY_MIN_CAPACITY 8
+#define RANGE_BLOCK_SIZE 256
+#define RANGE_PARALLEL_MIN_STEPS 4096
+#define RANGE_STEP_ULPS 4
+#define SWEEP_BLOCK_SIZE 256
+#define SWEEP_ROUND_BLOCKS 16
+#define SWEEP_LINE_SIZE 64
+#define SWEEP_VARIABLE_SIZE 64
+#define SWEEP_QUEUE_SHIFT 32
+#define SWEEP_DIMENSIONS_MAX 8
+#define REDUCE_NONE 0
+#define REDUCE_SUM 1
+#define REDUCE_MIN 2
+#define REDUCE_MAX 3
+#define REDUCE_MEAN 4
+#define REDUCE_COUNT 5
+#define TABLE_BLOCK_SIZE 64
+#define TABLE_FIELD_SIZE 64
+#define MEMO_BUCKETS 4096
+#define MEMO_MIN_NODES 4
+#define MEMO_MAX_DEPTH 1024
+#define TE_CONSTANT 1
+#define TE_ARITY_MASK 7
+#define TE_TYPE_MASK 0x1F
+#define BACKEND_TREE 0
+#define BACKEND_BYTECODE 1
+#define BACKEND_JIT 2
+#define BACKEND_COUNT 3
+#define OP_CONSTANT 0
+#define OP_VARIABLE 1
+#define OP_CALL1 2
+#define OP_CALL2 3
+#define OP_FUNCTION 4
+#define OP_CLOSURE 5
+#define OP_ADD 6
+#define OP_SUBTRACT 7
+#define OP_MULTIPLY 8
+#define OP_DIVIDE 9
+#define OP_NEGATE 10
+#define OP_ADD_CONSTANT 11
+#define OP_SUBTRACT_CONSTANT 12
+#define OP_MULTIPLY_CONSTANT 13
+#define OP_DIVIDE_CONSTANT 14
+#define OP_ADD_VARIABLE 15
+#define OP_SUBTRACT_VARIABLE 16
+#define OP_MULTIPLY_VARIABLE 17
+#define OP_DIVIDE_VARIABLE 18
+#define OPERATOR_COUNT 5
+#define BYTECODE_STACK_SIZE 64
+#define BYTECODE_MAX_DEPTH 1024
+#define JIT_INSTRUCTION_SIZE 128
+#define JIT_HOT_EVALUATIONS 64
+#define JIT_BLOCK_SIZE 65536
+#define JOBS_MAX 64
+#define JOB_BATCH_LINES 16384
+#define JOB_MIN_LINES 256
+#define JOB_TEXT_SIZE 1048576
+#define WRITER_TABLE_SIZE 32768
+#define LINE_BLANK 0
+#define LINE_EXPRESSION 1
+#define LINE_ASSIGNMENT 2
+#define LINE_INVALID 3
+#define LINE_PRINT 4
+#define LINE_RANGE 5
+#define LINE_SAVE 6
+#define LINE_LOAD 7
+#define LINE_CSV 8
+#define LINE_BINARY 9
+#define LINE_SWEEP 10
+#define LEXER_CHUNK_SIZE 16
+#define SSE2_DOUBLE_LANES 2
+#define JOB_RESULT 1
+#define JOB_ERROR 2
+#define OUTPUT_BUFFER_SIZE 65536
+#define DOUBLE_TEXT_SIZE 32
+#define POWERS_OF_TEN_MAX 22
+#define ROUNDING_TIE_MARGIN 1e-5
+#define LOG10_2 0.30102999566398120
+#define DECIMAL_BASE 10
+#define SCIENTIFIC_EXPONENT_MIN (-4)
+#define OUTPUT_TEXT 0
+#define OUTPUT_NDJSON 1
+#define OUTPUT_BINARY 2
+#define OUTPUT_FORMAT_COUNT 3
+#define RECORD_RESULT 0
+#define RECORD_POINT 1
+#define RECORD_ASSIGNMENT 2
+#define RECORD_VARIABLE 3
+#define RECORD_LOOP 4
+#define RECORD_INCREMENT 5
+#define RECORD_END 6
+#define RECORD_ERROR 7
+#define RECORD_KIND_COUNT 8
+#define RECORD_TEXT_SIZE 160
+#define RECORD_DIGITS_SHORT 15
+#define RECORD_DIGITS_EXACT 17
+#define RECORD_INTEGER_DIGITS 20
+#define RECORD_INTEGER_MAX 9007199254740992.0
+#define STAGE_READ 0
+#define STAGE_CLASSIFY 1
+#define STAGE_COMPILE 2
+#define STAGE_EVAL 3
+#define STAGE_SYMBOLS 4
+#define STAGE_OUTPUT 5
+#define STAGE_COUNT 6
+#define STAGE_DEPTH_MAX 8
+#define STATS_HISTOGRAM_SIZE 64
+#define NANOSECONDS_PER_SECOND 1000000000LL
+#define NANOSECONDS_PER_MICROSECOND 1e3
+#define NANOSECONDS_PER_MILLISECOND 1e6
+#define PERCENTILE_50 0.50
+#define PERCENTILE_90 0.90
+#define PERCENTILE_99 0.99
 
 // https://edstem.org/au/courses/19964/lessons/67046/slides/451584 A Def
 // structure, which is made of a variable name and a value. Named after the
@@ -68,6 +254,558 @@ typedef struct Loop {
   double end;
 } Loop;
 
+// An Options structure, which holds the settings given by command line
+// options other than variables and significant figures
+typedef struct Options {
+  int jobs;
+  int stats;
+  int backend;
+  int reactive;
+  int output;
+  const char* serve;
+  const char* state;
+} Options;
+
+// A StateHeader structure, which begins a state file written by @save. It is
+// followed by defCount StateDef records, loopCount StateLoop records and then
+// namesSize bytes of null-terminated names, so that a mapped file can be used
+// in place without being parsed
+typedef struct StateHeader {
+  char magic[STATE_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t defCount;
+  uint32_t loopCount;
+  uint32_t namesSize;
+} StateHeader;
+
+// A StateDef structure, which records a Def in a state file. name is the
+// offset of its name within the names of the file
+typedef struct StateDef {
+  double value;
+  uint32_t name;
+  uint32_t length;
+} StateDef;
+
+// A StateLoop structure, which records a Loop in a state file
+typedef struct StateLoop {
+  double start;
+  double increment;
+  double end;
+  uint32_t name;
+  uint32_t length;
+} StateLoop;
+
+// An OutputHeader structure, which begins the output of --output binary. It
+// is followed by records of recordSize bytes each, so that the output can be
+// mapped and used in place
+typedef struct OutputHeader {
+  char magic[OUTPUT_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t recordSize;
+} OutputHeader;
+
+// An OutputRecord structure, which is one record of --output binary. line is
+// the number of the input line that produced it (0 for the variables printed
+// before any input), kind is one of the RECORD_* kinds and error is 1 for
+// RECORD_ERROR. The name of the variable the record is about, if any, fills
+// the first nameLength bytes of name and the rest are zero
+typedef struct OutputRecord {
+  uint64_t line;
+  double value;
+  uint8_t kind;
+  uint8_t error;
+  uint8_t nameLength;
+  char name[VARIABLE_NAME_SIZE];
+} OutputRecord;
+
+// A LineScan structure, which describes a line after a single pass over it.
+// kind is one of the LINE_* kinds and length is the length of the line up to
+// its first null character. For an assignment, the stripped line is split in
+// place into the name and the expression; otherwise expression is the whole
+// stripped line
+typedef struct LineScan {
+  int kind;
+  size_t length;
+  char* name;
+  char* expression;
+} LineScan;
+
+// An ArenaBlock structure, which is one block of memory owned by an Arena.
+// data holds size bytes, of which the first used have been handed out
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaBlock;
+
+// An Arena structure, which hands out memory from large blocks and releases it
+// all at once. head is the block currently being filled, and blockSize is the
+// smallest block the arena allocates
+typedef struct Arena {
+  ArenaBlock* head;
+  size_t blockSize;
+} Arena;
+
+// A JitBlock structure, which is one mapping that native code is written into.
+// The first used of its size bytes hold code, and used is a whole number of
+// pages so that no two programs share a page
+typedef struct JitBlock {
+  struct JitBlock* next;
+  unsigned char* code;
+  size_t size;
+  size_t used;
+} JitBlock;
+
+// A MemoEntry structure, which records a subexpression of compiled
+// expressions by its structure. Until a second compiled expression contains
+// the same subexpression, tree is the node of the first expression. After
+// that, shared is set, tree is owned by the entry, and every occurrence has
+// been turned into a node that returns value. value is recomputed only when
+// one of the Def values in inputs no longer matches snapshot
+typedef struct MemoEntry {
+  unsigned int hash;
+  te_expr* tree;
+  int shared;
+  double value;
+  const double** inputs;
+  double* snapshot;
+  int inputCount;
+  unsigned long checked;
+  struct MemoEntry* next;
+  struct MemoEntry* older;
+} MemoEntry;
+
+// A MemoNode structure, which describes a node of a newly compiled expression
+// and the subtree below it. pure is set if the subtree only calls pure
+// functions, and variables if it reads at least one variable
+typedef struct MemoNode {
+  te_expr* node;
+  unsigned int hash;
+  int cost;
+  int pure;
+  int variables;
+} MemoNode;
+
+// The type that functions called by tinyexpr nodes are held as, void (*)(void),
+// until they are cast back to their own type
+typedef void (*TeFunction)(void);
+
+// A function which formats a value with a fixed number of significant figures
+// into text, returning the number of characters written
+typedef int (*DoubleFormatter)(char* text, double value);
+
+// An Instruction structure, which is one step of a Program. OP_CONSTANT and
+// OP_VARIABLE push operand.value or *operand.bound, and the other ops replace
+// the top arity values of the stack with the result of operand.function.
+// Closures are also passed context before their arguments. The operator ops
+// apply the operator instead, and those from OP_ADD_CONSTANT on take their
+// right operand from operand.value or *operand.bound rather than the stack
+typedef struct Instruction {
+  int op;
+  int arity;
+  union {
+    double value;
+    const double* bound;
+    TeFunction function;
+  } operand;
+  void* context;
+} Instruction;
+
+// A Program structure, which is a compiled tinyexpr tree lowered to a linear
+// sequence of stack instructions that fits in BYTECODE_STACK_SIZE slots.
+// evaluations counts how often the main thread has evaluated it. If native is
+// set, it is the same program as x86-64 code, taking the stack as its argument
+// and mapped over nativeSize bytes of block
+typedef struct Program {
+  const Instruction* code;
+  int length;
+  long evaluations;
+  double (*native)(double*);
+  size_t nativeSize;
+  JitBlock* block;
+} Program;
+
+// A TableBlock structure, which holds up to TABLE_BLOCK_SIZE rows of an @csv
+// or @binary table a column at a time, so that an expression can be evaluated
+// down each column in turn. Column i starts at columns + i * TABLE_BLOCK_SIZE
+// and holds values for the Def bound to bindings[i]. valid marks the rows that
+// were read without error
+typedef struct TableBlock {
+  int columnCount;
+  int rowCount;
+  double** bindings;
+  double* columns;
+  char valid[TABLE_BLOCK_SIZE];
+} TableBlock;
+
+// A CacheEntry structure, which maps the text of a stripped expression to its
+// compiled tinyexpr tree. compiled is NULL if the expression failed to compile.
+// program is the tree lowered for the selected backend, or NULL if the tree is
+// evaluated by tinyexpr
+typedef struct CacheEntry {
+  char* expression;
+  te_expr* compiled;
+  Program* program;
+  struct CacheEntry* next;
+} CacheEntry;
+
+// A LineJob structure, which is one line of a batch evaluated by worker
+// threads. kind is one of the LINE_* kinds. expression is the stripped
+// expression, or the right hand side of an assignment to name. sources lists
+// where each name the expression reads comes from: an earlier assignment in
+// the batch if >= 0, or defs[-1 - source] otherwise. An assignment that writes
+// a Def stores the value the variable has after this line in value (if
+// defined), so later lines can read it without waiting for the batch to end.
+// line is the number of the input line, for --output
+typedef struct LineJob {
+  unsigned long line;
+  int kind;
+  char* expression;
+  char* name;
+  int writes;
+  int previous;
+  int target;
+  int writerSlot;
+  int sourceStart;
+  int sourceCount;
+  int cacheable;
+  int level;
+  double result;
+  int status;
+  double value;
+  int defined;
+} LineJob;
+
+// A Writer structure, which records the latest assignment to a name in the
+// batch
+typedef struct Writer {
+  const char* name;
+  int job;
+} Writer;
+
+// A JobBatch structure, which holds the lines read since the last line that
+// had to be handled in order. Stripped lines are kept in text, which is never
+// moved while the batch holds lines. order lists the jobs sorted by level,
+// where every job depends only on jobs of lower levels
+typedef struct JobBatch {
+  LineJob jobs[JOB_BATCH_LINES];
+  int jobCount;
+  int order[JOB_BATCH_LINES];
+  int levelCounts[JOB_BATCH_LINES + 1];
+  char* text;
+  size_t textCapacity;
+  size_t textUsed;
+  int* sources;
+  int sourceCapacity;
+  int sourceCount;
+  Writer writers[WRITER_TABLE_SIZE];
+} JobBatch;
+
+// A Worker structure, which is a thread evaluating a slice of one level of a
+// JobBatch, along with scratch space it keeps between batches. Expressions it
+// compiles against Defs go in its own cache, which the main thread moves into
+// the expression cache after each batch. Entries of that cache are allocated
+// from arena
+typedef struct Worker {
+  pthread_t thread;
+  const int* order;
+  int jobCount;
+  te_variable* vars;
+  int varsCapacity;
+  CacheEntry* cache[EXPR_CACHE_BUCKETS];
+  Arena arena;
+} Worker;
+
+// A CompensatedSum structure, which is a running sum kept with Neumaier's
+// compensated summation. sum is the plain sum, and compensation collects the
+// low-order bits each addition to it loses, so sum + compensation stays
+// accurate however many terms are added
+typedef struct CompensatedSum {
+  double sum;
+  double compensation;
+} CompensatedSum;
+
+// A SweepChunk structure, which holds what one block of a sweep produced:
+// either the lines printed for it, along with where in them each invalid
+// result is reported, or the partial reduction of its results
+typedef struct SweepChunk {
+  char* text;
+  size_t length;
+  int* errors;
+  int errorCount;
+  int invalid;
+  CompensatedSum sum;
+  double minimum;
+  double maximum;
+} SweepChunk;
+
+struct Sweep;
+
+// A SweepWorker structure, which is a thread evaluating blocks of a sweep with
+// its own copy of the expression, bound to its own loopValues. Points are
+// evaluated a tile at a time, whose columns hold the values of each loop
+// variable. queue packs the first and one past the last block it has left
+// (see sweep_queue()), so that other workers can steal from the end of it
+typedef struct SweepWorker {
+  pthread_t thread;
+  struct Sweep* sweep;
+  double loopValues[SWEEP_DIMENSIONS_MAX];
+  double* bindings[SWEEP_DIMENSIONS_MAX];
+  double columns[SWEEP_DIMENSIONS_MAX * TABLE_BLOCK_SIZE];
+  TableBlock tile;
+  te_expr* expr;
+  Program* program;
+  uint64_t queue;
+} SweepWorker;
+
+// A Sweep structure, which describes the grid of points formed by several
+// loop variables, being evaluated across threads. A @range is a sweep of one
+// loop variable. roundFirst is the first point of the round of blocks being
+// evaluated, and chunks holds what each block of the round produced
+typedef struct Sweep {
+  const Loop* loops[SWEEP_DIMENSIONS_MAX];
+  long steps[SWEEP_DIMENSIONS_MAX];
+  int dimensions;
+  long points;
+  long roundFirst;
+  int reduction;
+  int sigFigures;
+  SweepChunk* chunks;
+  SweepWorker* workers;
+  int workerCount;
+} Sweep;
+
+// Compiled expressions bind the addresses of Def values, so every entry is
+// dropped whenever a Def is added (see expr_cache_clear()). Entries and their
+// text are allocated from cacheArena, which is reset along with the cache
+static CacheEntry* exprCache[EXPR_CACHE_BUCKETS];
+static int exprCacheSize = 0;
+static Arena cacheArena = {NULL, CACHE_ARENA_BLOCK_SIZE};
+
+// Subexpressions of cached expressions by structure, and the shared entries
+// among them, newest first. Both are allocated from cacheArena and dropped
+// with the cache. memoChanges counts changes to Def values, so an entry
+// checked since the last change is known to be current
+static MemoEntry* memoTable[MEMO_BUCKETS];
+static MemoEntry* memoShared = NULL;
+static int memoCount = 0;
+static unsigned long memoChanges = 0;
+
+// The nodes of the expression being memoised, in post-order
+static MemoNode* memoNodes = NULL;
+static int memoNodesCapacity = 0;
+static int memoNodeCount = 0;
+
+// Whether the nodes te_compile() builds have been checked against what the
+// te_node_*() functions assume, and whether they matched (see te_layout_ok())
+static int teLayoutChecked = 0;
+static int teLayoutMatches = 0;
+
+// How cached and ranged expressions are evaluated, one of the BACKEND_* values
+static int evalBackend = BACKEND_BYTECODE;
+
+// The number of threads given by --jobs, which @range and the sweep commands
+// may use as well as batches of lines
+static int evalJobs = 1;
+// The commands that evaluate an expression over a grid of loop variables,
+// indexed by the reduction each one prints (see sweep_handler())
+static const char* const sweepCommands[REDUCE_COUNT] = {
+    "@sweep", "@sum", "@min", "@max", "@mean"};
+
+static const char* const backendNames[BACKEND_COUNT] = {"tree", "bytecode",
+                                                        "jit"};
+
+// The functions tinyexpr calls for +, -, *, / and negation, in the order of
+// OP_ADD to OP_NEGATE. They only apply the operator, so calls to them are
+// lowered to the operator itself. Found once, the first time a tree is lowered
+static TeFunction operatorFunctions[OPERATOR_COUNT];
+static int operatorsFound = 0;
+
+// The mappings native code is written into, newest first. Code is packed
+// together so that hot programs share pages, and is released along with the
+// expression cache
+static JitBlock* jitBlocks = NULL;
+
+// The instructions of the tree being lowered. Only the main thread lowers trees
+static Instruction* lowerCode = NULL;
+static int lowerCapacity = 0;
+static int lowerLength = 0;
+
+// A Formula structure, which holds what reactive mode knows about the Def with
+// the same index. expression is the expression the Def was last assigned,
+// which reads the Defs in inputs, or NULL if it holds a plain value.
+// dependents lists the Defs whose formulas read this one. visited and changed
+// are the last propagation that reached the Def and that changed its value
+typedef struct Formula {
+  char* expression;
+  int* inputs;
+  int inputCount;
+  int* dependents;
+  int dependentCount;
+  int dependentCapacity;
+  unsigned long visited;
+  unsigned long changed;
+} Formula;
+
+// Reactive mode state. formulas parallels the Def array, and propagation
+// counts propagations so that visited and changed never need clearing.
+// reactiveOrder holds the Defs a search finds and reactiveStack the search
+// itself, and both have room for formulasCapacity Defs
+static int reactiveEnabled = 0;
+static int reactivePropagating = 0;
+static Formula* formulas = NULL;
+static int formulasCapacity = 0;
+static unsigned long propagation = 0;
+static int* reactiveOrder = NULL;
+static int* reactiveStack = NULL;
+
+// The socket a server listens on, which it removes when it is stopped
+static const char* servePath = NULL;
+
+// Set in a session forked by a server, whose client may not read or write
+// files with the server's privileges
+static int serveSession = 0;
+
+// A Symbol structure, which indexes a Def or Loop by name. isLoop selects which
+// array index refers to, and a NULL name marks an empty slot
+typedef struct Symbol {
+  const char* name;
+  int isLoop;
+  int index;
+} Symbol;
+
+// Open addressing hash table over the names of every Def and Loop. Its size is
+// always a power of 2 and at least double the number of symbols
+static Symbol* symbolTable = NULL;
+static int symbolTableSize = 0;
+static int symbolCount = 0;
+
+// Variable names are interned into this arena and never freed, so Def/Loop
+// names and symbols can share the same pointer
+static Arena sessionArena = {NULL, SESSION_ARENA_BLOCK_SIZE};
+
+// Scratch memory for handling one line or command line option, which is
+// released once it has been handled
+static Arena lineArena = {NULL, LINE_ARENA_BLOCK_SIZE};
+
+// Allocated lengths of the Def and Loop arrays, which grow geometrically
+static int defCapacity = 0;
+static int loopCapacity = 0;
+
+// Persistent tinyexpr bindings, where teVars[i] binds the value of defs[i].
+// Only Defs added since the last update are bound, unless the Def array has
+// been moved by realloc
+static te_variable* teVars = NULL;
+static int teVarsCapacity = 0;
+static int teVarsSize = 0;
+static const Def* teVarsDefs = NULL;
+
+// The subset of teVars that is passed to te_compile() for one expression
+static te_variable* exprVars = NULL;
+static int exprVarsCapacity = 0;
+
+// A LineReader structure, which reads input that cannot be mapped a block at a
+// time. buffer holds input read but not yet processed between start and end
+typedef struct LineReader {
+  int fd;
+  char* buffer;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  int eof;
+} LineReader;
+
+// A LineEditor structure, which holds the line being typed at a terminal and
+// the history of lines entered before it. cursor is where the next character
+// typed goes, historyIndex is the history entry being shown (historyCount for
+// a new line, which is kept in draft while the history is shown), and escape
+// collects the bytes of an escape sequence sent by a cursor or editing key
+typedef struct LineEditor {
+  char* line;
+  size_t length;
+  size_t capacity;
+  size_t cursor;
+  char** history;
+  int historyCount;
+  int historyIndex;
+  char* draft;
+  char escape[EDITOR_ESCAPE_MAX];
+  int escapeLength;
+  int afterReturn;
+} LineEditor;
+
+// The terminal settings the line editor restores when it stops, and whether
+// it is running
+static struct termios editorTermios;
+static int editorRunning = 0;
+
+// Worker threads used by --jobs, and the batch of lines they share
+static Worker workers[JOBS_MAX];
+static JobBatch batch;
+
+// Everything written to stdout is collected here and written in large chunks.
+// If stdout is a terminal, it is instead written after every input line
+static char outputBuffer[OUTPUT_BUFFER_SIZE];
+static size_t outputUsed = 0;
+static int outputInteractive = 0;
+
+// The format given by --output, one of the OUTPUT_* values, and the number of
+// the input line whose output is being written, counting from 1
+static int outputFormat = OUTPUT_TEXT;
+static unsigned long outputLine = 0;
+static const char* const outputNames[OUTPUT_FORMAT_COUNT] = {"text", "ndjson",
+                                                             "binary"};
+
+// The kind of each RECORD_* record, as written by --output ndjson
+static const char* const recordKinds[RECORD_KIND_COUNT] = {
+    "result", "point", "assignment", "variable",
+    "loop",   "increment", "end",    "error"};
+
+// Every power of ten that is exactly representable as a double
+static const double powersOfTen[POWERS_OF_TEN_MAX + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// printf formats for each number of significant figures, used by
+// format_significant() for values it cannot format exactly itself
+static const char* const doubleFormats[SIG_FIGURES_MAX + 1] = {
+    NULL,    NULL,    "%.2g",  "%.3g", "%.4g",
+    "%.5g",  "%.6g",  "%.7g",  "%.8g", "%.9g"};
+
+// A StageStats structure, which totals the time spent in one stage of
+// handling input for --stats. histogram[i] counts the events that took
+// between 2^(i-1) and 2^i nanoseconds. Worker threads update these, so every
+// field is only changed atomically
+typedef struct StageStats {
+  unsigned long count;
+  unsigned long long totalNs;
+  unsigned long allocations;
+  unsigned long histogram[STATS_HISTOGRAM_SIZE];
+} StageStats;
+
+// A StageFrame structure, which is a stage that has been entered but not left.
+// elapsed is the time spent in the stage itself so far, not counting any stage
+// entered from within it
+typedef struct StageFrame {
+  int stage;
+  long long elapsed;
+} StageFrame;
+
+// Nothing is timed or counted unless --stats is given
+static int statsEnabled = 0;
+static StageStats stageStats[STAGE_COUNT];
+static const char* const stageNames[STAGE_COUNT] = {
+    "read", "classify", "compile", "eval", "symbols", "output"};
+
+// The stages each thread is in, innermost last, and when the innermost stage
+// was last entered or resumed
+static __thread StageFrame stageStack[STAGE_DEPTH_MAX];
+static __thread int stageDepth = 0;
+static __thread long long stageMark = 0;
+
 /**
  * variable_print()
  * ----------------
@@ -87,350 +825,5961 @@ void variable_print(Def** defs, const int* defSize, Loop** loops,
                     const int* loopSize, int sigFigures);
 int valid_variable_name(const char* variableName);
 void add_def(Def** defs, int* defSize, const char* name, double value);
+void reactive_propagate(Def** defs, int* defSize, const int* changed,
+                        int changedCount, int sigFigures);
+void add_loop(Loop** loops, int* loopSize, const char* name, double start,
+              double increment, double end);
+int valid_loop_values(double start, double increment, double end);
+void sweep_evaluate(const char* expression, const Loop* const* loops,
+                    int dimensions, long points, int reduction, Def** defs,
+                    const int* defSize, int sigFigures);
 
 /**
- * print_expression()
+ * stats_now()
  * ----------------
- * Prints the evaluated result of an expression with the specified number of
- *significant figures. In the format Result = <expression-result>
+ * Reads the monotonic clock.
  *
- * result: The computed numerical result of an expression.
- * sigFigures: The number of significant figures to use when printing.
+ * Returns: The current time in nanoseconds.
+ *
+ **/
+long long stats_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * stats_begin()
+ * ----------------
+ * Enters a stage for --stats. Time stops counting towards the stage the thread
+ *was already in until the matching stats_end(). Does nothing unless --stats
+ *was given.
+ *
+ * stage: One of the STAGE_* stages.
  *
  * Returns: void
  *
  **/
-void print_expression(double result, int sigFigures) {
-  char expressionFormat[EXPRESSION_FORMAT_SIZE];
-
-  // Create formats and print with sigFigures values
-  snprintf(expressionFormat, sizeof(expressionFormat), "Result = %%.%dg\n",
-           sigFigures);
-
-  printf(expressionFormat, result);
+void stats_begin(int stage) {
+  if (!statsEnabled) {
+    return;
+  }
+  const long long now = stats_now();
+  if (stageDepth > 0) {
+    stageStack[stageDepth - 1].elapsed += now - stageMark;
+  }
+  if (stageDepth < STAGE_DEPTH_MAX) {
+    stageStack[stageDepth].stage = stage;
+    stageStack[stageDepth].elapsed = 0;
+  }
+  stageDepth++;
+  stageMark = now;
 }
 
 /**
- * handle_new_variable()
+ * stats_end()
  * ----------------
- * Handles variable assignment, ensuring uniqueness, overwriting existing values
- *if needed, or adding new definitions.
+ * Leaves the stage entered by the last stats_begin() and records the time spent
+ *in it. Does nothing unless --stats was given.
  *
- * defs: Pointer to the array of defined variables.
- * defSize: Pointer to the number of defined variables.
- * loops: Pointer to the array of loop variables.
- * loopSize: Pointer to the number of loop variables.
- * name: Name of the variable being assigned.
- * value: Value to assign to the variable.
- * sigFigures: Number of significant figures to use when printing the
- *assignment.
+ * events: The number of events, such as evaluations, the time covered. Each
+ *is counted as taking an equal share of it.
  *
  * Returns: void
  *
  **/
-void handle_new_variable(Def** defs, int* defSize, Loop** loops,
-                         const int* loopSize, const char* name,
-                         const double value, const int sigFigures) {
-  // Successful assignment is always printed
-  char newVariableFormat[VARIABLE_NAME_SIZE];
-  snprintf(newVariableFormat, sizeof(newVariableFormat), "%%s = %%.%dg\n",
-           sigFigures);
+void stats_end(int events) {
+  if (!statsEnabled) {
+    return;
+  }
+  const long long now = stats_now();
+  const int depth = --stageDepth;
+  if (depth >= STAGE_DEPTH_MAX || events <= 0) {
+    stageMark = now;
+    return;
+  }
+  StageFrame* frame = &stageStack[depth];
+  frame->elapsed += now - stageMark;
+  stageMark = now;
 
-  printf(newVariableFormat, name, value);
+  StageStats* stats = &stageStats[frame->stage];
+  const unsigned long long eventNs = frame->elapsed / events;
+  const int bucket =
+      eventNs ? STATS_HISTOGRAM_SIZE - __builtin_clzll(eventNs) : 0;
+  __atomic_fetch_add(&stats->count, events, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->totalNs, frame->elapsed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->histogram[bucket < STATS_HISTOGRAM_SIZE
+                                           ? bucket
+                                           : STATS_HISTOGRAM_SIZE - 1],
+                     events, __ATOMIC_RELAXED);
+}
 
-  // If there is a loop variable with this name, do nothing
-  if (*loopSize != 0) {
-    for (int i = 0; i < *loopSize; ++i) {
-      if (strcmp((*loops)[i].name, name) == 0) {
-        return;
-      }
-    }
+/**
+ * stats_allocation()
+ * ----------------
+ * Counts an allocation against the stage the calling thread is in, if any.
+ *Only uqexpr's own allocation points call this: arena blocks, the arrays of
+ *Defs and Loops, lowered programs and blocks of native code. Memory that
+ *tinyexpr or the C library allocate is not counted.
+ *
+ * Returns: void
+ *
+ **/
+void stats_allocation(void) {
+  if (statsEnabled && stageDepth > 0 && stageDepth <= STAGE_DEPTH_MAX) {
+    StageStats* stats = &stageStats[stageStack[stageDepth - 1].stage];
+    __atomic_fetch_add(&stats->allocations, 1, __ATOMIC_RELAXED);
   }
+}
 
-  // If there are no defs, add this one
-  if (*defSize == 0) {
-    add_def(defs, defSize, name, value);
-    return;
-  }
 
-  // If a def with the same name already exists, overwrite it
-  for (int i = 0; i < *defSize; ++i) {
-    if (strcmp((*defs)[i].name, name) == 0) {
-      (*defs)[i].value = value;
-      return;
+/**
+ * stats_percentile()
+ * ----------------
+ * Estimates a percentile of the time taken by the events of a stage from its
+ *histogram.
+ *
+ * stats: The stage.
+ * fraction: The percentile to estimate, between 0 and 1.
+ *
+ * Returns: An upper bound on the percentile in microseconds.
+ *
+ **/
+double stats_percentile(const StageStats* stats, double fraction) {
+  const double rank = fraction * stats->count;
+  unsigned long seen = 0;
+  int bucket = 0;
+  for (; bucket < STATS_HISTOGRAM_SIZE - 1; ++bucket) {
+    seen += stats->histogram[bucket];
+    if (seen >= rank) {
+      break;
     }
   }
-  // If every check is passed, add the new def
-  add_def(defs, defSize, name, value);
+  return (double)(1ULL << bucket) / NANOSECONDS_PER_MICROSECOND;
 }
 
 /**
- * tiny_expr()
+ * stats_print()
  * ----------------
- * Evaluates a mathematical expression using tinyexpr, allowing for variable
- *substitutions.
+ * Prints a summary of every stage to stderr: how often it ran, the time spent
+ *in it in total and per event, and how many allocations it made at uqexpr's
+ *own allocation points (see stats_allocation()).
  *
- * expression: Null-terminated string representing the mathematical expression
- *to evaluate. defs: Pointer to the array of defined variables. defSize: Pointer
- *to the number of defined variables.
+ * Returns: void
  *
- * Returns: The computed result of the expression. If evaluation fails, returns
- *NAN.
+ **/
+void stats_print(void) {
+  fprintf(stderr, "%-9s %10s %11s %9s %9s %9s %9s %10s\n", "stage", "count",
+          "total ms", "mean us", "p50 us", "p90 us", "p99 us", "allocs");
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    const StageStats* stats = &stageStats[i];
+    const double mean =
+        stats->count ? stats->totalNs / NANOSECONDS_PER_MICROSECOND /
+                           stats->count
+                     : 0.0;
+    fprintf(stderr, "%-9s %10lu %11.3f %9.3f %9.3f %9.3f %9.3f %10lu\n",
+            stageNames[i], stats->count,
+            stats->totalNs / NANOSECONDS_PER_MILLISECOND, mean,
+            stats->count ? stats_percentile(stats, PERCENTILE_50) : 0.0,
+            stats->count ? stats_percentile(stats, PERCENTILE_90) : 0.0,
+            stats->count ? stats_percentile(stats, PERCENTILE_99) : 0.0,
+            stats->allocations);
+  }
+}
+
+/**
+ * output_flush()
+ * ----------------
+ * Writes everything in the output buffer to stdout.
  *
- * Errors: If the expression is invalid, returns NAN.
+ * Returns: void
  *
- *21/3/25 11:30
  **/
-double tiny_expr(const char* expression, Def** defs, const int* defSize) {
-  // Create an array of te_variable using the provided defs
-  te_variable teVars[*defSize];
-
-  // Initialise result, default to NAN if invalid input
-  double result = NAN;
-
-  // Populate teVars if variables exist
-  // tiny_expr() 21/3/25 14:07
-  if (*defSize != 0) {
-    for (int i = 0; i < *defSize; i++) {
-      teVars[i].name = (*defs)[i].name;
-      teVars[i].address = &(*defs)[i].value;  // Use existing values from defs
-      teVars[i].type = TE_VARIABLE;
-      teVars[i].context = NULL;
+void output_flush(void) {
+  stats_begin(STAGE_OUTPUT);
+  size_t written = 0;
+  while (written < outputUsed) {
+    const ssize_t numWritten =
+        write(STDOUT_FILENO, outputBuffer + written, outputUsed - written);
+    if (numWritten < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numWritten <= 0) {
+      break;
     }
+    written += numWritten;
   }
+  outputUsed = 0;
+  stats_end(1);
+}
 
-  int errPos;
-  // Parse and compile the expression using defs
-  te_expr* expr = te_compile(expression, teVars, *defSize, &errPos);
+/**
+ * output_line_done()
+ * ----------------
+ * Called once an input line has been handled, so that output reaches a
+ *terminal as soon as it is produced.
+ *
+ * Returns: void
+ *
+ **/
+void output_line_done(void) {
+  if (outputInteractive) {
+    output_flush();
+  }
+}
 
-  if (expr) {
-    result = te_eval(expr);
-    te_free(expr);
+/**
+ * output_reserve()
+ * ----------------
+ * Makes room for a number of characters at the end of the output buffer.
+ *
+ * length: The number of characters needed, at most OUTPUT_BUFFER_SIZE.
+ *
+ * Returns: A pointer to where the characters should be written.
+ *
+ **/
+char* output_reserve(size_t length) {
+  if (outputUsed + length > OUTPUT_BUFFER_SIZE) {
+    output_flush();
   }
-  return result;
+  return outputBuffer + outputUsed;
 }
 
 /**
- * expression_handler()
+ * output_text()
  * ----------------
- * Processes an expression by evaluating it and printing the result if valid.
+ * Appends characters to the output buffer.
  *
- * strippedLine: Null-terminated string containing the expression to evaluate.
- * defs: Pointer to the array of defined variables.
- * defSize: Pointer to the number of defined variables.
- * sigFigures: Number of significant figures to use when printing the result.
+ * text: The characters to append, which need not be null-terminated.
+ * length: The number of characters in text.
  *
  * Returns: void
  *
- * Errors: If the expression is invalid, prints an error message to stderr.
- *
  **/
-void expression_handler(char strippedLine[], Def** defs, const int* defSize,
-                        const int sigFigures) {
-  const double result = tiny_expr(strippedLine, defs, defSize);
-  if (isnan(result)) {
-    fprintf(stderr, runningError);
-    return;
+void output_text(const char* text, size_t length) {
+  while (length > 0) {
+    const size_t chunk =
+        (length < OUTPUT_BUFFER_SIZE) ? length : OUTPUT_BUFFER_SIZE;
+    memcpy(output_reserve(chunk), text, chunk);
+    outputUsed += chunk;
+    text += chunk;
+    length -= chunk;
   }
-  print_expression(result, sigFigures);
 }
 
 /**
- * assignment_handler()
+ * output_string()
  * ----------------
- * Processes an assignment operation, validating variable names and evaluating
- *the assigned expression.
+ * Appends a null-terminated string to the output buffer.
  *
- * strippedLine: Null-terminated string containing the assignment operation.
- * defs: Pointer to the array of defined variables.
- * defSize: Pointer to the number of defined variables.
- * loops: Pointer to the array of loop variables.
- * loopSize: Pointer to the number of loop variables.
- * sigFigures: Number of significant figures to use when printing the
- *assignment.
+ * string: The string to append.
  *
  * Returns: void
  *
- * Errors: If the assignment is invalid, prints an error message to stderr.
+ **/
+void output_string(const char* string) {
+  output_text(string, strlen(string));
+}
+
+/**
+ * scale_by_ten()
+ * ----------------
+ * Multiplies a value by a power of ten, in steps of at most the largest power
+ *that is exactly representable. Each step rounds once, so the result is within
+ *a few units in the last place of the exact product.
+ *
+ * value: The value to scale.
+ * scale: The power of ten to scale by, which may be negative.
+ *
+ * Returns: The scaled value.
  *
  **/
-void assignment_handler(char strippedLine[], Def** defs, int* defSize,
-                        Loop** loops, const int* loopSize,
-                        const int sigFigures) {
-  // Split up string based on '='
-  char* tokens[ASSIGNMENT_TOKEN_SIZE] = {NULL, NULL};
-  int count = 0;
+static inline __attribute__((always_inline)) double scale_by_ten(double value,
+                                                                 int scale) {
+  for (; scale > POWERS_OF_TEN_MAX; scale -= POWERS_OF_TEN_MAX) {
+    value *= powersOfTen[POWERS_OF_TEN_MAX];
+  }
+  for (; scale < -POWERS_OF_TEN_MAX; scale += POWERS_OF_TEN_MAX) {
+    value /= powersOfTen[POWERS_OF_TEN_MAX];
+  }
+  return (scale >= 0) ? value * powersOfTen[scale]
+                      : value / powersOfTen[-scale];
+}
 
-  char* myptr = strtok(strippedLine, "=");
-  while (myptr != NULL && count < ASSIGNMENT_TOKEN_SIZE) {
-    tokens[count] = myptr;
-    count += 1;
-    myptr = strtok(NULL, "=");
+/**
+ * format_significant()
+ * ----------------
+ * Formats a value exactly as printf("%.<sigFigures>g") does. It is always
+ *inlined into a formatter for each number of significant figures (see
+ *doubleFormatters), so that sigFigures is a constant and its digit loops and
+ *powers of ten are fixed when the formatter is compiled. Finite values are
+ *rounded to sigFigures digits by scaling with powers of ten, estimating the
+ *exponent from the binary exponent. The rounding of values too close to a
+ *half to call is left to snprintf, as is formatting infinities and NaNs.
+ *
+ * text: Buffer of at least DOUBLE_TEXT_SIZE characters to write into.
+ * value: The value to format.
+ * sigFigures: The number of significant figures, from 2 to 9.
+ *
+ * Returns: The number of characters written, not counting the null
+ *terminator.
+ *
+ **/
+static inline __attribute__((always_inline)) int format_significant(
+    char* text, double value, const int sigFigures) {
+  if (value == 0) {
+    const char* zero = signbit(value) ? "-0" : "0";
+    const int length = strlen(zero);
+    memcpy(text, zero, length + 1);
+    return length;
+  }
+  if (!isfinite(value)) {
+    return snprintf(text, DOUBLE_TEXT_SIZE, doubleFormats[sigFigures], value);
   }
 
-  // check if expression is valid and store it
-  const double result = tiny_expr(tokens[1], defs, defSize);
-  if (isnan(result)) {
-    fprintf(stderr, runningError);
+  // Scale the magnitude so that its integer part has sigFigures digits. The
+  // estimate of the exponent is never too big, and at most one too small
+  const double magnitude = fabs(value);
+  int exponent = (int)floor(ilogb(magnitude) * LOG10_2);
+  double scaled = scale_by_ten(magnitude, sigFigures - 1 - exponent);
+  if (scaled >= powersOfTen[sigFigures]) {
+    exponent++;
+    scaled = scale_by_ten(magnitude, sigFigures - 1 - exponent);
+  }
+
+  // Scaling is out by a few units in the last place at most, so only a
+  // fraction very close to a half is in doubt
+  const double integral = floor(scaled);
+  const double fraction = scaled - integral;
+  if (fabs(fraction - 0.5) < ROUNDING_TIE_MARGIN) {
+    return snprintf(text, DOUBLE_TEXT_SIZE, doubleFormats[sigFigures], value);
+  }
+  unsigned long digitValue = (unsigned long)integral + (fraction > 0.5);
+  if (digitValue >= (unsigned long)powersOfTen[sigFigures]) {
+    digitValue /= DECIMAL_BASE;
+    exponent++;
+  }
+
+  // Write out the digits and drop trailing zeros, as %g does
+  char digits[SIG_FIGURES_MAX];
+  for (int i = sigFigures - 1; i >= 0; --i) {
+    digits[i] = '0' + digitValue % DECIMAL_BASE;
+    digitValue /= DECIMAL_BASE;
+  }
+  int digitCount = sigFigures;
+  while (digitCount > 1 && digits[digitCount - 1] == '0') {
+    digitCount--;
+  }
+
+  int length = 0;
+  if (value < 0) {
+    text[length++] = '-';
+  }
+
+  if (exponent < SCIENTIFIC_EXPONENT_MIN || exponent >= sigFigures) {
+    // Scientific notation, e.g. 1.23e+07, with at least two exponent digits
+    text[length++] = digits[0];
+    if (digitCount > 1) {
+      text[length++] = '.';
+      memcpy(text + length, digits + 1, digitCount - 1);
+      length += digitCount - 1;
+    }
+    text[length++] = 'e';
+    text[length++] = (exponent < 0) ? '-' : '+';
+    int exponentValue = abs(exponent);
+    if (exponentValue >= DECIMAL_BASE * DECIMAL_BASE) {
+      text[length++] = '0' + exponentValue / (DECIMAL_BASE * DECIMAL_BASE);
+      exponentValue %= DECIMAL_BASE * DECIMAL_BASE;
+    }
+    text[length++] = '0' + exponentValue / DECIMAL_BASE;
+    text[length++] = '0' + exponentValue % DECIMAL_BASE;
+  } else if (exponent >= 0) {
+    // Fixed notation with an integer part, e.g. 123.4
+    memcpy(text + length, digits, exponent + 1);
+    length += exponent + 1;
+    if (digitCount > exponent + 1) {
+      text[length++] = '.';
+      memcpy(text + length, digits + exponent + 1, digitCount - exponent - 1);
+      length += digitCount - exponent - 1;
+    }
+  } else {
+    // Fixed notation below one, e.g. 0.001234
+    text[length++] = '0';
+    text[length++] = '.';
+    for (int i = -1; i > exponent; --i) {
+      text[length++] = '0';
+    }
+    memcpy(text + length, digits, digitCount);
+    length += digitCount;
+  }
+  text[length] = '\0';
+  return length;
+}
+
+/**
+ * format_double_2() to format_double_9()
+ * ----------------
+ * Format a value exactly as printf("%.2g") to printf("%.9g") do.
+ *
+ * text: Buffer of at least DOUBLE_TEXT_SIZE characters to write into.
+ * value: The value to format.
+ *
+ * Returns: The number of characters written, not counting the null
+ *terminator.
+ *
+ **/
+int format_double_2(char* text, double value) {
+  return format_significant(text, value, 2);
+}
+
+int format_double_3(char* text, double value) {
+  return format_significant(text, value, 3);
+}
+
+int format_double_4(char* text, double value) {
+  return format_significant(text, value, 4);
+}
+
+int format_double_5(char* text, double value) {
+  return format_significant(text, value, 5);
+}
+
+int format_double_6(char* text, double value) {
+  return format_significant(text, value, 6);
+}
+
+int format_double_7(char* text, double value) {
+  return format_significant(text, value, 7);
+}
+
+int format_double_8(char* text, double value) {
+  return format_significant(text, value, 8);
+}
+
+int format_double_9(char* text, double value) {
+  return format_significant(text, value, 9);
+}
+
+// The formatter for each number of significant figures
+static const DoubleFormatter doubleFormatters[SIG_FIGURES_MAX + 1] = {
+    NULL,            NULL,            format_double_2, format_double_3,
+    format_double_4, format_double_5, format_double_6, format_double_7,
+    format_double_8, format_double_9};
+
+/**
+ * format_double()
+ * ----------------
+ * Formats a value exactly as printf("%.<sigFigures>g") does, with the
+ *formatter specialised for sigFigures.
+ *
+ * text: Buffer of at least DOUBLE_TEXT_SIZE characters to write into.
+ * value: The value to format.
+ * sigFigures: The number of significant figures, from 2 to 9.
+ *
+ * Returns: The number of characters written, not counting the null
+ *terminator.
+ *
+ **/
+int format_double(char* text, double value, int sigFigures) {
+  return doubleFormatters[sigFigures](text, value);
+}
+
+/**
+ * output_double()
+ * ----------------
+ * Appends a value to the output buffer, formatted as printf("%.<sigFigures>g")
+ *would format it.
+ *
+ * value: The value to append.
+ * sigFigures: The number of significant figures, from 2 to 9.
+ *
+ * Returns: void
+ *
+ **/
+void output_double(double value, int sigFigures) {
+  outputUsed += format_double(output_reserve(DOUBLE_TEXT_SIZE), value,
+                              sigFigures);
+}
+
+/**
+ * output_message()
+ * ----------------
+ * Appends a message meant for a person to the output buffer. Messages are
+ *left out of the records written by --output ndjson and binary.
+ *
+ * message: The null-terminated message to append.
+ *
+ * Returns: void
+ *
+ **/
+void output_message(const char* message) {
+  if (outputFormat == OUTPUT_TEXT) {
+    output_string(message);
+  }
+}
+
+/**
+ * output_header()
+ * ----------------
+ * Appends the OutputHeader that begins the output of --output binary.
+ *
+ * Returns: void
+ *
+ **/
+void output_header(void) {
+  OutputHeader header;
+  memcpy(header.magic, outputMagic, OUTPUT_MAGIC_SIZE);
+  header.version = OUTPUT_VERSION;
+  header.byteOrder = OUTPUT_BYTE_ORDER;
+  header.recordSize = sizeof(OutputRecord);
+  output_text((const char*)&header, sizeof(header));
+}
+
+/**
+ * record_text()
+ * ----------------
+ * Copies a null-terminated string into a record being formatted, without its
+ *null terminator.
+ *
+ * text: Where to copy the string.
+ * string: The string to copy.
+ *
+ * Returns: The number of characters copied.
+ *
+ **/
+int record_text(char* text, const char* string) {
+  const size_t length = strlen(string);
+  memcpy(text, string, length);
+  return length;
+}
+
+/**
+ * record_integer()
+ * ----------------
+ * Writes a whole number in decimal into a record being formatted.
+ *
+ * text: Where to write the number.
+ * value: The number to write.
+ *
+ * Returns: The number of digits written.
+ *
+ **/
+int record_integer(char* text, uint64_t value) {
+  char digits[RECORD_INTEGER_DIGITS];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % DECIMAL_BASE;
+    value /= DECIMAL_BASE;
+  } while (value > 0);
+  for (int i = 0; i < count; ++i) {
+    text[i] = digits[count - 1 - i];
+  }
+  return count;
+}
+
+/**
+ * format_record()
+ * ----------------
+ * Formats a record for --output ndjson or binary, tagged with the current
+ *input line. An ndjson record is a JSON object on a line of its own, such as
+ *{"line":3,"kind":"assignment","name":"x","value":0.1,"error":false}, whose
+ *value reads back as exactly the same double. An infinite value is the string
+ *"inf" or "-inf", and a NaN, as in an error record, is null. A binary record
+ *is an OutputRecord. Sweep workers format records in
+ *parallel, so this only reads shared state.
+ *
+ * text: Buffer of at least RECORD_TEXT_SIZE bytes to write into.
+ * kind: The kind of record, one of the RECORD_* kinds.
+ * name: The name of the variable the record is about, or NULL if none.
+ * value: The value of the record.
+ *
+ * Returns: The number of bytes written.
+ *
+ **/
+int format_record(char* text, int kind, const char* name, double value) {
+  const size_t nameLength = (name != NULL) ? strlen(name) : 0;
+  const int error = kind == RECORD_ERROR;
+  if (outputFormat == OUTPUT_BINARY) {
+    OutputRecord record;
+    memset(&record, 0, sizeof(record));
+    record.line = outputLine;
+    record.value = value;
+    record.kind = kind;
+    record.error = error;
+    record.nameLength = nameLength;
+    if (name != NULL) {
+      memcpy(record.name, name, nameLength);
+    }
+    memcpy(text, &record, sizeof(record));
+    return sizeof(record);
+  }
+
+  int length = record_text(text, "{\"line\":");
+  length += record_integer(text + length, outputLine);
+  length += record_text(text + length, ",\"kind\":\"");
+  length += record_text(text + length, recordKinds[kind]);
+  if (name != NULL) {
+    length += record_text(text + length, "\",\"name\":\"");
+    memcpy(text + length, name, nameLength);
+    length += nameLength;
+    length += record_text(text + length, "\",\"value\":");
+  } else {
+    length += record_text(text + length, "\",\"name\":null,\"value\":");
+  }
+
+  // Whole numbers are written directly. Anything else is written with 15
+  // digits if that reads back exactly, and otherwise with the 17 digits that
+  // always do
+  if (isnan(value)) {
+    length += record_text(text + length, "null");
+  } else if (isinf(value)) {
+    length +=
+        record_text(text + length, (value > 0) ? "\"inf\"" : "\"-inf\"");
+  } else if (value == floor(value) && fabs(value) < RECORD_INTEGER_MAX &&
+             (value != 0 || !signbit(value))) {
+    if (value < 0) {
+      text[length++] = '-';
+    }
+    length += record_integer(text + length, fabs(value));
+  } else {
+    char* number = text + length;
+    int numberLength = snprintf(number, DOUBLE_TEXT_SIZE, "%.*g",
+                                RECORD_DIGITS_SHORT, value);
+    if (strtod(number, NULL) != value) {
+      numberLength = snprintf(number, DOUBLE_TEXT_SIZE, "%.*g",
+                              RECORD_DIGITS_EXACT, value);
+    }
+    length += numberLength;
+  }
+  length += record_text(text + length,
+                        error ? ",\"error\":true}\n" : ",\"error\":false}\n");
+  return length;
+}
+
+/**
+ * output_record()
+ * ----------------
+ * Appends a record for --output ndjson or binary to the output buffer.
+ *
+ * kind: The kind of record, one of the RECORD_* kinds.
+ * name: The name of the variable the record is about, or NULL if none.
+ * value: The value of the record.
+ *
+ * Returns: void
+ *
+ **/
+void output_record(int kind, const char* name, double value) {
+  outputUsed += format_record(output_reserve(RECORD_TEXT_SIZE), kind, name,
+                              value);
+}
+
+/**
+ * output_result()
+ * ----------------
+ * Appends the result of an expression to the output buffer, in the format
+ *Result = <result>, followed by when <var> = <value> if it was evaluated for a
+ *loop variable. As records, the result is followed by a point record for the
+ *loop variable.
+ *
+ * result: The result of the expression.
+ * loop: The loop variable the expression was evaluated for, or NULL if none.
+ * loopValue: The value of the loop variable.
+ * sigFigures: The number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ **/
+void output_result(double result, const Loop* loop, double loopValue,
+                   int sigFigures) {
+  if (outputFormat != OUTPUT_TEXT) {
+    output_record(RECORD_RESULT, NULL, result);
+    if (loop != NULL) {
+      output_record(RECORD_POINT, loop->name, loopValue);
+    }
+    return;
+  }
+  output_string("Result = ");
+  output_double(result, sigFigures);
+  if (loop != NULL) {
+    output_text(" when ", 6);
+    output_string(loop->name);
+    output_text(" = ", 3);
+    output_double(loopValue, sigFigures);
+  }
+  output_text("\n", 1);
+}
+
+/**
+ * report_error()
+ * ----------------
+ * Reports an error in a command, expression or assignment to stderr. With
+ *--output ndjson or binary, an error record is also written in its place
+ *among the other records.
+ *
+ * Returns: void
+ *
+ **/
+void report_error(void) {
+  fprintf(stderr, runningError);
+  if (outputFormat != OUTPUT_TEXT) {
+    output_record(RECORD_ERROR, NULL, NAN);
+  }
+}
+
+/**
+ * print_expression()
+ * ----------------
+ * Prints the evaluated result of an expression with the specified number of
+ *significant figures. In the format Result = <expression-result>
+ *
+ * result: The computed numerical result of an expression.
+ * sigFigures: The number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ **/
+void print_expression(double result, int sigFigures) {
+  stats_begin(STAGE_OUTPUT);
+  output_result(result, NULL, 0, sigFigures);
+  stats_end(1);
+}
+
+/**
+ * arena_alloc()
+ * ----------------
+ * Allocates memory from an arena. A new block is started when the current one
+ *is full, large enough for size if that is bigger than the arena's block size.
+ *
+ * arena: The arena to allocate from.
+ * size: The number of bytes needed.
+ *
+ * Returns: Suitably aligned memory, which lives until the arena is reset.
+ *
+ **/
+void* arena_alloc(Arena* arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  ArenaBlock* block = arena->head;
+  if (block == NULL || block->size - block->used < size) {
+    const size_t blockSize =
+        (size > arena->blockSize) ? size : arena->blockSize;
+    stats_allocation();
+    block = malloc(sizeof(ArenaBlock) + blockSize);
+    block->next = arena->head;
+    block->size = blockSize;
+    block->used = 0;
+    arena->head = block;
+  }
+  void* memory = block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+/**
+ * arena_strndup()
+ * ----------------
+ * Copies characters into an arena as a null-terminated string.
+ *
+ * arena: The arena to allocate from.
+ * string: The characters to copy, which need not be null-terminated.
+ * length: The number of characters to copy.
+ *
+ * Returns: The copy, which lives until the arena is reset.
+ *
+ **/
+char* arena_strndup(Arena* arena, const char* string, size_t length) {
+  char* copy = arena_alloc(arena, length + 1);
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+/**
+ * arena_reset()
+ * ----------------
+ * Releases everything allocated from an arena. If it has grown past one block,
+ *its blocks are replaced with a single block that holds as much, so the same
+ *work needs no further allocation next time.
+ *
+ * arena: The arena to reset.
+ *
+ * Returns: void
+ *
+ **/
+void arena_reset(Arena* arena) {
+  ArenaBlock* block = arena->head;
+  if (block == NULL) {
+    return;
+  }
+  if (block->next == NULL) {
+    block->used = 0;
+    return;
+  }
+
+  size_t total = 0;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    total += block->size;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+  const size_t blockSize = arena->blockSize;
+  arena->blockSize = total;
+  arena_alloc(arena, 0);
+  arena->blockSize = blockSize;
+}
+
+/**
+ * hash_string()
+ * ----------------
+ * Hashes a string using 32-bit FNV-1a.
+ *
+ * string: Null-terminated string to hash.
+ *
+ * Returns: The hash of the string.
+ *
+ **/
+unsigned int hash_string(const char* string) {
+  unsigned int hash = FNV_OFFSET_BASIS;
+  for (const unsigned char* c = (const unsigned char*)string; *c; ++c) {
+    hash ^= *c;
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * hash_bytes()
+ * ----------------
+ * Continues a 32-bit FNV-1a hash over some bytes.
+ *
+ * hash: The hash so far, or FNV_OFFSET_BASIS to start a new one.
+ * bytes: The bytes to hash.
+ * length: The number of bytes.
+ *
+ * Returns: The updated hash.
+ *
+ **/
+unsigned int hash_bytes(unsigned int hash, const void* bytes, size_t length) {
+  const unsigned char* c = bytes;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= c[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * intern_name()
+ * ----------------
+ * Copies a variable name into the session arena.
+ *
+ * name: Null-terminated variable name to copy.
+ *
+ * Returns: The interned copy of name, which lives until the program exits.
+ *
+ **/
+char* intern_name(const char* name) {
+  return arena_strndup(&sessionArena, name, strlen(name));
+}
+
+/**
+ * symbol_lookup()
+ * ----------------
+ * Finds the Def or Loop with the given name.
+ *
+ * name: Null-terminated variable name to look up.
+ *
+ * Returns: The symbol for name, or NULL if there is no variable with that name.
+ * If several variables share a name, the first one added is returned.
+ *
+ **/
+Symbol* symbol_lookup(const char* name) {
+  if (symbolTableSize == 0) {
+    return NULL;
+  }
+
+  const unsigned int mask = symbolTableSize - 1;
+  for (unsigned int slot = hash_string(name) & mask;
+       symbolTable[slot].name != NULL; slot = (slot + 1) & mask) {
+    if (strcmp(symbolTable[slot].name, name) == 0) {
+      return &symbolTable[slot];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * symbol_place()
+ * ----------------
+ * Stores a symbol in the first free slot of its probe sequence, without
+ *checking for duplicates or growing the table.
+ *
+ * symbol: The symbol to store.
+ *
+ * Returns: void
+ *
+ **/
+void symbol_place(Symbol symbol) {
+  const unsigned int mask = symbolTableSize - 1;
+  unsigned int slot = hash_string(symbol.name) & mask;
+  while (symbolTable[slot].name != NULL) {
+    slot = (slot + 1) & mask;
+  }
+  symbolTable[slot] = symbol;
+}
+
+/**
+ * symbol_insert()
+ * ----------------
+ * Interns a variable name and indexes it, doubling the symbol table when it
+ *becomes half full. Names that are already present keep their existing symbol,
+ *so duplicates can later be found by unique_name_check().
+ *
+ * name: Null-terminated variable name.
+ * isLoop: 1 if index refers to the Loop array, 0 for the Def array.
+ * index: Position of the variable in its array.
+ *
+ * Returns: The interned copy of name.
+ *
+ **/
+char* symbol_insert(const char* name, int isLoop, int index) {
+  if ((symbolCount + 1) * 2 > symbolTableSize) {
+    Symbol* oldTable = symbolTable;
+    const int oldSize = symbolTableSize;
+
+    symbolTableSize = oldSize ? oldSize * 2 : SYMBOL_TABLE_MIN_SIZE;
+    symbolTable = calloc(symbolTableSize, sizeof(Symbol));
+    for (int i = 0; i < oldSize; ++i) {
+      if (oldTable[i].name != NULL) {
+        symbol_place(oldTable[i]);
+      }
+    }
+    free(oldTable);
+  }
+
+  char* interned = intern_name(name);
+  if (symbol_lookup(interned) == NULL) {
+    Symbol symbol = {interned, isLoop, index};
+    symbol_place(symbol);
+    symbolCount++;
+  }
+  return interned;
+}
+
+/**
+ * handle_new_variable()
+ * ----------------
+ * Handles variable assignment, ensuring uniqueness, overwriting existing values
+ *if needed, or adding new definitions. Loop variables are found through the
+ *symbol table and are never overwritten. In reactive mode, a Def whose value
+ *changes has its dependents recomputed.
+ *
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * name: Name of the variable being assigned.
+ * value: Value to assign to the variable.
+ * sigFigures: Number of significant figures to use when printing the
+ *assignment.
+ *
+ * Returns: void
+ *
+ **/
+void handle_new_variable(Def** defs, int* defSize, const char* name,
+                         const double value, const int sigFigures) {
+  // Successful assignment is always printed
+  stats_begin(STAGE_OUTPUT);
+  if (outputFormat != OUTPUT_TEXT) {
+    output_record(RECORD_ASSIGNMENT, name, value);
+  } else {
+    output_string(name);
+    output_text(" = ", 3);
+    output_double(value, sigFigures);
+    output_text("\n", 1);
+  }
+  stats_end(1);
+
+  // If there is a loop variable with this name, do nothing. If a def with the
+  // same name already exists, overwrite it
+  stats_begin(STAGE_SYMBOLS);
+  Symbol* symbol = symbol_lookup(name);
+  if (symbol != NULL) {
+    if (symbol->isLoop == 0) {
+      // Memoised values that read this Def are stale if its value changes
+      double* defValue = &(*defs)[symbol->index].value;
+      const int changed = memcmp(defValue, &value, sizeof(double)) != 0;
+      if (changed) {
+        memoChanges++;
+      }
+      *defValue = value;
+      if (changed && reactiveEnabled && !reactivePropagating) {
+        stats_end(1);
+        reactive_propagate(defs, defSize, &symbol->index, 1, sigFigures);
+        return;
+      }
+    }
+  } else {
+    // If every check is passed, add the new def
+    add_def(defs, defSize, name, value);
+  }
+  stats_end(1);
+}
+
+/**
+ * te_node_arity()
+ * ----------------
+ * Finds the number of arguments a tinyexpr node takes.
+ *
+ * type: The type of the node.
+ *
+ * Returns: The number of arguments.
+ *
+ **/
+int te_node_arity(int type) {
+  return (type & (TE_FUNCTION0 | TE_CLOSURE0)) ? (type & TE_ARITY_MASK) : 0;
+}
+
+/**
+ * te_node_size()
+ * ----------------
+ * Finds the number of bytes tinyexpr allocates for a node, which is the fixed
+ *fields followed by a pointer for each argument and, for a closure, one for
+ *its context.
+ *
+ * node: The node.
+ *
+ * Returns: The size of the node.
+ *
+ **/
+size_t te_node_size(const te_expr* node) {
+  const size_t pointers = te_node_arity(node->type) +
+                          ((node->type & TE_CLOSURE0) ? 1 : 0);
+  return sizeof(te_expr) - sizeof(void*) + pointers * sizeof(void*);
+}
+
+/**
+ * te_node_context()
+ * ----------------
+ * Finds the context a closure node passes to its function, which tinyexpr
+ *keeps after the arguments.
+ *
+ * node: The closure node.
+ *
+ * Returns: The context.
+ *
+ **/
+void* te_node_context(const te_expr* node) {
+  return node->parameters[te_node_arity(node->type)];
+}
+
+/**
+ * te_node_set_closure()
+ * ----------------
+ * Turns a node into a pure closure of no arguments. The node must take at
+ *least one argument, so that it has room for the context.
+ *
+ * node: The node to replace, whose arguments have been moved or freed.
+ * function: The function the node calls.
+ * context: The context the function is passed.
+ *
+ * Returns: void
+ *
+ **/
+void te_node_set_closure(te_expr* node, double (*function)(void*),
+                         void* context) {
+  node->type = TE_CLOSURE0 | TE_FLAG_PURE;
+  node->function = (const void*)(uintptr_t)function;
+  node->parameters[0] = context;
+}
+
+/**
+ * te_layout_probe()
+ * ----------------
+ * A closure for te_layout_ok() to compile and call.
+ *
+ * context: Pointer to the value to return.
+ *
+ * Returns: The value.
+ *
+ **/
+double te_layout_probe(void* context) {
+  return *(const double*)context;
+}
+
+/**
+ * te_layout_probe_add()
+ * ----------------
+ * A closure of one argument for te_layout_ok() to compile.
+ *
+ * context: Pointer to the value to add.
+ * value: The argument.
+ *
+ * Returns: The sum.
+ *
+ **/
+double te_layout_probe_add(void* context, double value) {
+  return *(const double*)context + value;
+}
+
+/**
+ * te_layout_ok()
+ * ----------------
+ * Checks once that the nodes te_compile() builds are laid out as the
+ *te_node_*() functions and TE_CONSTANT assume, as tinyexpr does not publish
+ *its node layout. A constant and a closure are compiled and inspected, then
+ *the closure is rewritten the way memo_replace() rewrites nodes and evaluated
+ *again. Memoisation and lowering are only used if this succeeds, and
+ *otherwise expressions are left to tinyexpr.
+ *
+ * Returns: 1 if the layout matches, else 0.
+ *
+ **/
+int te_layout_ok(void) {
+  if (teLayoutChecked) {
+    return teLayoutMatches;
+  }
+  double x = 2;
+  double context = 3;
+  te_variable vars[] = {
+      {"x", &x, TE_VARIABLE, NULL},
+      {"f", (const void*)(uintptr_t)te_layout_probe_add,
+       TE_CLOSURE1 | TE_FLAG_PURE, &context}};
+  int errPos;
+  te_expr* constant = te_compile("1.5", vars, 2, &errPos);
+  te_expr* closure = te_compile("f(x)", vars, 2, &errPos);
+
+  int matches = constant != NULL && closure != NULL &&
+                constant->type == TE_CONSTANT && constant->value == 1.5 &&
+                closure->type == (TE_CLOSURE1 | TE_FLAG_PURE) &&
+                te_node_context(closure) == &context;
+  if (matches) {
+    const te_expr* argument = closure->parameters[0];
+    matches = argument->type == TE_VARIABLE && argument->bound == &x &&
+              te_eval(closure) == x + context;
+  }
+  if (matches) {
+    te_free(closure->parameters[0]);
+    te_node_set_closure(closure, te_layout_probe, &context);
+    matches = te_eval(closure) == context;
+  }
+  te_free(constant);
+  te_free(closure);
+  teLayoutMatches = matches;
+  teLayoutChecked = 1;
+  return matches;
+}
+
+/**
+ * memo_refresh()
+ * ----------------
+ * Recomputes the value of a shared memo entry if any Def it reads has changed
+ *since it was last computed.
+ *
+ * memo: The entry to refresh.
+ *
+ * Returns: void
+ *
+ **/
+void memo_refresh(MemoEntry* memo) {
+  int changed = 0;
+  for (int i = 0; i < memo->inputCount; ++i) {
+    if (memcmp(memo->inputs[i], &memo->snapshot[i], sizeof(double)) != 0) {
+      memo->snapshot[i] = *memo->inputs[i];
+      changed = 1;
+    }
+  }
+  memo->checked = memoChanges;
+  if (changed) {
+    memo->value = te_eval(memo->tree);
+  }
+}
+
+/**
+ * memo_value()
+ * ----------------
+ * Called by tinyexpr to evaluate a node that has been replaced by a shared
+ *memo entry. Worker threads only reach it once memo_refresh_all() has made
+ *every entry current, so it then changes nothing.
+ *
+ * context: Pointer to the MemoEntry.
+ *
+ * Returns: The value of the subexpression.
+ *
+ **/
+double memo_value(void* context) {
+  MemoEntry* memo = context;
+  if (memo->checked != memoChanges) {
+    memo_refresh(memo);
+  }
+  return memo->value;
+}
+
+/**
+ * memo_refresh_all()
+ * ----------------
+ * Makes every shared memo entry current, so that cached expressions can be
+ *evaluated on several threads.
+ *
+ * Returns: void
+ *
+ **/
+void memo_refresh_all(void) {
+  for (MemoEntry* memo = memoShared; memo != NULL; memo = memo->older) {
+    if (memo->checked != memoChanges) {
+      memo_refresh(memo);
+    }
+  }
+}
+
+/**
+ * memo_unwrap()
+ * ----------------
+ * Finds the subexpression a node stands for, looking through nodes that have
+ *been replaced by a shared memo entry.
+ *
+ * node: The node.
+ *
+ * Returns: The subexpression.
+ *
+ **/
+const te_expr* memo_unwrap(const te_expr* node) {
+  if (node->type == (TE_CLOSURE0 | TE_FLAG_PURE) &&
+      node->function == (const void*)(uintptr_t)memo_value) {
+    return ((const MemoEntry*)te_node_context(node))->tree;
+  }
+  return node;
+}
+
+/**
+ * memo_equal()
+ * ----------------
+ * Compares the structure of two subexpressions.
+ *
+ * first: The first subexpression.
+ * second: The second subexpression.
+ *
+ * Returns: 1 if they compute the same thing from the same variables, else 0.
+ *
+ **/
+int memo_equal(const te_expr* first, const te_expr* second) {
+  first = memo_unwrap(first);
+  second = memo_unwrap(second);
+  if (first == second) {
+    return 1;
+  }
+  if (first->type != second->type) {
+    return 0;
+  }
+  if (first->type == TE_VARIABLE) {
+    return first->bound == second->bound;
+  }
+  if (first->type == TE_CONSTANT) {
+    return memcmp(&first->value, &second->value, sizeof(double)) == 0;
+  }
+  if (first->function != second->function) {
+    return 0;
+  }
+  for (int i = 0; i < te_node_arity(first->type); ++i) {
+    if (!memo_equal(first->parameters[i], second->parameters[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * memo_collect()
+ * ----------------
+ * Lists a subtree of a newly compiled expression in memoNodes in post-order,
+ *so that every node follows the nodes below it.
+ *
+ * node: The root of the subtree.
+ * depth: The depth of node in the expression.
+ *
+ * Returns: The index of node in memoNodes, or -1 if the subtree is deeper
+ *than MEMO_MAX_DEPTH.
+ *
+ **/
+int memo_collect(te_expr* node, int depth) {
+  if (depth > MEMO_MAX_DEPTH) {
+    return -1;
+  }
+  unsigned int hash = hash_bytes(FNV_OFFSET_BASIS, &node->type, sizeof(int));
+  int cost = 1;
+  int pure = 1;
+  int variables = 0;
+
+  if (node->type == TE_VARIABLE) {
+    hash = hash_bytes(hash, &node->bound, sizeof(node->bound));
+    variables = 1;
+  } else if (node->type == TE_CONSTANT) {
+    hash = hash_bytes(hash, &node->value, sizeof(double));
+  } else {
+    hash = hash_bytes(hash, &node->function, sizeof(node->function));
+    pure = (node->type & TE_FLAG_PURE) && !(node->type & TE_CLOSURE0);
+    for (int i = 0; i < te_node_arity(node->type); ++i) {
+      const int childIndex = memo_collect(node->parameters[i], depth + 1);
+      if (childIndex < 0) {
+        return -1;
+      }
+      const MemoNode* child = &memoNodes[childIndex];
+      hash = hash_bytes(hash, &child->hash, sizeof(unsigned int));
+      cost += child->cost;
+      pure = pure && child->pure;
+      variables = variables || child->variables;
+    }
+  }
+
+  if (memoNodeCount == memoNodesCapacity) {
+    memoNodesCapacity =
+        memoNodesCapacity ? memoNodesCapacity * 2 : ARRAY_MIN_CAPACITY;
+    memoNodes = realloc(memoNodes, memoNodesCapacity * sizeof(MemoNode));
+  }
+  MemoNode* info = &memoNodes[memoNodeCount];
+  info->node = node;
+  info->hash = hash;
+  info->cost = cost;
+  info->pure = pure;
+  info->variables = variables;
+  return memoNodeCount++;
+}
+
+/**
+ * memo_add_inputs()
+ * ----------------
+ * Adds every Def a subexpression reads to the inputs of a memo entry, once
+ *each.
+ *
+ * memo: The entry.
+ * node: The subexpression.
+ *
+ * Returns: void
+ *
+ **/
+void memo_add_inputs(MemoEntry* memo, const te_expr* node) {
+  node = memo_unwrap(node);
+  if (node->type == TE_VARIABLE) {
+    for (int i = 0; i < memo->inputCount; ++i) {
+      if (memo->inputs[i] == node->bound) {
+        return;
+      }
+    }
+    memo->inputs[memo->inputCount] = node->bound;
+    memo->snapshot[memo->inputCount++] = *node->bound;
+    return;
+  }
+  for (int i = 0; i < te_node_arity(node->type); ++i) {
+    memo_add_inputs(memo, node->parameters[i]);
+  }
+}
+
+/**
+ * memo_replace()
+ * ----------------
+ * Turns a node into one that returns the value of a shared memo entry. The
+ *node must be a function of at least one argument (see te_node_set_closure()).
+ *
+ * node: The node to replace, whose arguments have been moved or freed.
+ * memo: The entry.
+ *
+ * Returns: void
+ *
+ **/
+void memo_replace(te_expr* node, MemoEntry* memo) {
+  te_node_set_closure(node, memo_value, memo);
+}
+
+/**
+ * memo_share()
+ * ----------------
+ * Makes a memo entry shared, once a second expression contains its
+ *subexpression. The subexpression is moved out of the first expression into
+ *the entry and replaced there.
+ *
+ * memo: The entry.
+ * cost: The number of nodes in the subexpression.
+ *
+ * Returns: void
+ *
+ **/
+void memo_share(MemoEntry* memo, int cost) {
+  te_expr* node = memo->tree;
+  const size_t size = te_node_size(node);
+  te_expr* moved = malloc(size);
+  memcpy(moved, node, size);
+  memo_replace(node, memo);
+
+  memo->tree = moved;
+  memo->shared = 1;
+  memo->inputs = arena_alloc(&cacheArena, cost * sizeof(const double*));
+  memo->snapshot = arena_alloc(&cacheArena, cost * sizeof(double));
+  memo->inputCount = 0;
+  memo_add_inputs(memo, moved);
+  memo->value = te_eval(moved);
+  memo->checked = memoChanges;
+  memo->older = memoShared;
+  memoShared = memo;
+}
+
+/**
+ * memo_rewrite()
+ * ----------------
+ * Looks for subexpressions of a newly compiled expression that earlier cached
+ *expressions also contain, and replaces them with shared memo entries. Only
+ *subexpressions of pure functions that read a variable and have at least
+ *MEMO_MIN_NODES nodes are considered; constant subexpressions have already
+ *been folded by te_compile(). The largest matches are replaced first, and the
+ *rest of the expression is recorded for later expressions to match. Very deep
+ *expressions are left alone, so the walks over them cannot overflow the stack,
+ *as are all expressions if te_layout_ok() fails.
+ *
+ * expr: The compiled expression, which is about to be cached.
+ *
+ * Returns: void
+ *
+ **/
+void memo_rewrite(te_expr* expr) {
+  memoNodeCount = 0;
+  if (!te_layout_ok() || memo_collect(expr, 0) < 0) {
+    return;
+  }
+
+  // Walking post-order backwards visits every node before those below it
+  for (int i = memoNodeCount - 1; i >= 0; --i) {
+    const MemoNode* info = &memoNodes[i];
+    if (!info->pure || !info->variables || info->cost < MEMO_MIN_NODES) {
+      continue;
+    }
+    const unsigned int bucket = info->hash % MEMO_BUCKETS;
+    MemoEntry* memo = memoTable[bucket];
+    while (memo != NULL &&
+           (memo->hash != info->hash || !memo_equal(memo->tree, info->node))) {
+      memo = memo->next;
+    }
+
+    if (memo == NULL) {
+      memo = arena_alloc(&cacheArena, sizeof(MemoEntry));
+      memo->hash = info->hash;
+      memo->tree = info->node;
+      memo->shared = 0;
+      memo->next = memoTable[bucket];
+      memoTable[bucket] = memo;
+      memoCount++;
+      continue;
+    }
+    if (!memo->shared) {
+      memo_share(memo, info->cost);
+    }
+
+    // The entry now computes this subtree, so skip the nodes below it
+    for (int j = 0; j < te_node_arity(info->node->type); ++j) {
+      te_free(info->node->parameters[j]);
+    }
+    memo_replace(info->node, memo);
+    i -= info->cost - 1;
+  }
+}
+
+/**
+ * memo_clear()
+ * ----------------
+ * Forgets every memo entry and frees the subexpressions of shared entries.
+ *Called when the expression cache is cleared, as cached expressions are what
+ *refer to the entries.
+ *
+ * Returns: void
+ *
+ **/
+void memo_clear(void) {
+  if (memoCount == 0) {
+    return;
+  }
+  for (MemoEntry* memo = memoShared; memo != NULL; memo = memo->older) {
+    te_free(memo->tree);
+  }
+  memoShared = NULL;
+  memset(memoTable, 0, sizeof(memoTable));
+  memoCount = 0;
+}
+
+/**
+ * program_emit()
+ * ----------------
+ * Appends the instructions that compute a tinyexpr node to lowerCode, after
+ *the instructions for each of its arguments from left to right.
+ *
+ * node: The node to lower.
+ * height: The number of values already on the stack when the node is computed.
+ * depth: The depth of node in the tree.
+ *
+ * Returns: 1 if the node was lowered, or 0 if it is too deep, needs too many
+ *stack slots or is not a type of node that tinyexpr evaluates.
+ *
+ **/
+int program_emit(const te_expr* node, int height, int depth) {
+  const int type = node->type & TE_TYPE_MASK;
+  const int arity = te_node_arity(node->type);
+  const int function = (type & TE_FUNCTION0) != 0;
+  const int closure = (type & TE_CLOSURE0) != 0;
+  if (depth > BYTECODE_MAX_DEPTH || height + arity >= BYTECODE_STACK_SIZE) {
+    return 0;
+  }
+
+  Instruction instruction;
+  instruction.arity = arity;
+  instruction.context = NULL;
+  if (type == TE_CONSTANT) {
+    instruction.op = OP_CONSTANT;
+    instruction.operand.value = node->value;
+  } else if (type == TE_VARIABLE) {
+    instruction.op = OP_VARIABLE;
+    instruction.operand.bound = node->bound;
+  } else if (function != closure) {
+    for (int i = 0; i < arity; ++i) {
+      if (program_emit(node->parameters[i], height + i, depth + 1) == 0) {
+        return 0;
+      }
+    }
+    instruction.operand.function = (TeFunction)(uintptr_t)node->function;
+    if (closure) {
+      instruction.op = OP_CLOSURE;
+      instruction.context = te_node_context(node);
+    } else if (arity == 1 || arity == 2) {
+      instruction.op = (arity == 1) ? OP_CALL1 : OP_CALL2;
+      for (int i = 0; i < OPERATOR_COUNT; ++i) {
+        if (instruction.operand.function == operatorFunctions[i] &&
+            arity == ((OP_ADD + i == OP_NEGATE) ? 1 : 2)) {
+          instruction.op = OP_ADD + i;
+        }
+      }
+
+      // Fold a constant or variable right operand into the operator
+      const Instruction* right = &lowerCode[lowerLength - 1];
+      if (instruction.op >= OP_ADD && instruction.op <= OP_DIVIDE &&
+          (right->op == OP_CONSTANT || right->op == OP_VARIABLE)) {
+        instruction.op += (right->op == OP_CONSTANT)
+                              ? OP_ADD_CONSTANT - OP_ADD
+                              : OP_ADD_VARIABLE - OP_ADD;
+        instruction.arity = 1;
+        instruction.operand = right->operand;
+        lowerLength--;
+      }
+    } else {
+      instruction.op = OP_FUNCTION;
+    }
+  } else {
+    return 0;
+  }
+
+  if (lowerLength == lowerCapacity) {
+    lowerCapacity = lowerCapacity ? lowerCapacity * 2 : ARRAY_MIN_CAPACITY;
+    lowerCode = realloc(lowerCode, lowerCapacity * sizeof(Instruction));
+  }
+  lowerCode[lowerLength++] = instruction;
+  return 1;
+}
+
+/**
+ * program_find_operators()
+ * ----------------
+ * Finds the functions tinyexpr calls for each operator by compiling a use of
+ *it against two variables, so that it cannot be folded into a constant.
+ *
+ * Returns: void
+ *
+ **/
+void program_find_operators(void) {
+  static const char* const operators[OPERATOR_COUNT] = {"x+y", "x-y", "x*y",
+                                                        "x/y", "-x"};
+  double x = 0;
+  double y = 0;
+  te_variable vars[] = {{"x", &x, TE_VARIABLE, NULL},
+                        {"y", &y, TE_VARIABLE, NULL}};
+
+  for (int i = 0; i < OPERATOR_COUNT; ++i) {
+    int errPos;
+    te_expr* expr = te_compile(operators[i], vars, 2, &errPos);
+    if (expr != NULL && (expr->type & TE_FUNCTION0)) {
+      operatorFunctions[i] = (TeFunction)(uintptr_t)expr->function;
+    }
+    te_free(expr);
+  }
+  operatorsFound = 1;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+/**
+ * jit_put()
+ * ----------------
+ * Writes machine code bytes followed by a little-endian immediate.
+ *
+ * at: Where to write the code.
+ * bytes: The bytes to write before the immediate.
+ * length: The number of bytes.
+ * immediate: The immediate value to write after them.
+ * immediateSize: The number of bytes of immediate to write, up to 8.
+ *
+ * Returns: A pointer to just after the code written.
+ *
+ **/
+unsigned char* jit_put(unsigned char* at, const char* bytes, size_t length,
+                       uint64_t immediate, size_t immediateSize) {
+  memcpy(at, bytes, length);
+  memcpy(at + length, &immediate, immediateSize);
+  return at + length + immediateSize;
+}
+
+/**
+ * jit_compile()
+ * ----------------
+ * Translates a program into x86-64 code that takes the stack as its only
+ *argument and keeps it in r12. Each stack slot is known when the code is
+ *generated, so values move straight between memory and the registers the
+ *System V calling convention passes them in. The same functions are called
+ *with the same arguments as the interpreter, and operators become the SSE2
+ *instruction that computes them. The code is appended to the newest JitBlock
+ *on pages of its own, which are only writable while code is being written to
+ *them, so pages holding the code of other programs are never made writable
+ *again. If that fails, the program is left to the interpreter.
+ *
+ * program: The program to translate, which is given its native code.
+ *
+ * Returns: void
+ *
+ **/
+void jit_compile(Program* program) {
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  const size_t bound = ((program->length + 1) * JIT_INSTRUCTION_SIZE +
+                        pageSize - 1) / pageSize * pageSize;
+  JitBlock* block = jitBlocks;
+  if (block == NULL || block->size - block->used < bound) {
+    const size_t size = bound > JIT_BLOCK_SIZE ? bound : JIT_BLOCK_SIZE;
+    unsigned char* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      return;
+    }
+    stats_allocation();
+    block = malloc(sizeof(JitBlock));
+    block->code = code;
+    block->size = size;
+    block->used = 0;
+    block->next = jitBlocks;
+    jitBlocks = block;
+  } else if (mprotect(block->code + block->used, bound,
+                      PROT_READ | PROT_WRITE) != 0) {
+    return;
+  }
+
+  // push r12; mov r12, rdi
+  unsigned char* start = block->code + block->used;
+  unsigned char* at = jit_put(start, "\x41\x54\x49\x89\xFC", 5, 0, 0);
+  int height = 0;
+  for (int i = 0; i < program->length; ++i) {
+    const Instruction* instruction = &program->code[i];
+    uint64_t bits;
+    if (instruction->op == OP_CONSTANT || instruction->op == OP_VARIABLE) {
+      if (instruction->op == OP_CONSTANT) {
+        // mov rax, value
+        memcpy(&bits, &instruction->operand.value, sizeof(bits));
+        at = jit_put(at, "\x48\xB8", 2, bits, sizeof(bits));
+      } else {
+        // mov rax, bound; mov rax, [rax]
+        at = jit_put(at, "\x48\xB8", 2,
+                     (uintptr_t)instruction->operand.bound, sizeof(bits));
+        at = jit_put(at, "\x48\x8B\x00", 3, 0, 0);
+      }
+      // mov [r12 + slot], rax
+      at = jit_put(at, "\x49\x89\x84\x24", 4, height * sizeof(double), 4);
+      height++;
+      continue;
+    }
+
+    height -= instruction->arity;
+    if (instruction->op == OP_NEGATE) {
+      // mov rax, [r12 + slot]; btc rax, 63; mov [r12 + slot], rax
+      at = jit_put(at, "\x49\x8B\x84\x24", 4, height * sizeof(double), 4);
+      at = jit_put(at, "\x48\x0F\xBA\xF8\x3F", 5, 0, 0);
+      at = jit_put(at, "\x49\x89\x84\x24", 4, height * sizeof(double), 4);
+      height++;
+      continue;
+    }
+
+    if (instruction->op >= OP_ADD && instruction->op <= OP_DIVIDE_VARIABLE) {
+      // movsd xmm0, [r12 + slot]
+      static const char operations[] = {0x58, 0x5C, 0x59, 0x5E};
+      const int op = instruction->op;
+      const int which = (op <= OP_DIVIDE)            ? op - OP_ADD
+                        : (op <= OP_DIVIDE_CONSTANT) ? op - OP_ADD_CONSTANT
+                                                     : op - OP_ADD_VARIABLE;
+      const char operation = operations[which];
+      at = jit_put(at, "\xF2\x41\x0F\x10\x84\x24", 6,
+                   height * sizeof(double), 4);
+      if (op <= OP_DIVIDE) {
+        // addsd/subsd/mulsd/divsd xmm0, [r12 + slot]
+        char operate[] = "\xF2\x41\x0F\x00\x84\x24";
+        operate[3] = operation;
+        at = jit_put(at, operate, 6, (height + 1) * sizeof(double), 4);
+      } else {
+        // mov rax, value; movq xmm1, rax; op xmm0, xmm1
+        // or mov rax, bound; op xmm0, [rax]
+        char operate[] = "\xF2\x0F\x00\xC1";
+        operate[2] = operation;
+        memcpy(&bits, &instruction->operand, sizeof(bits));
+        at = jit_put(at, "\x48\xB8", 2, bits, sizeof(bits));
+        if (op <= OP_DIVIDE_CONSTANT) {
+          at = jit_put(at, "\x66\x48\x0F\x6E\xC8", 5, 0, 0);
+        } else {
+          operate[3] = 0x00;
+        }
+        at = jit_put(at, operate, 4, 0, 0);
+      }
+    } else {
+      if (instruction->op == OP_CLOSURE) {
+        // mov rdi, context
+        at = jit_put(at, "\x48\xBF", 2, (uintptr_t)instruction->context,
+                     sizeof(bits));
+      }
+      for (int j = 0; j < instruction->arity; ++j) {
+        // movsd xmmj, [r12 + slot]
+        char load[] = "\xF2\x41\x0F\x10\x84\x24";
+        load[4] |= j << 3;
+        at = jit_put(at, load, 6, (height + j) * sizeof(double), 4);
+      }
+      // mov rax, function; call rax
+      at = jit_put(at, "\x48\xB8", 2,
+                   (uintptr_t)instruction->operand.function, sizeof(bits));
+      at = jit_put(at, "\xFF\xD0", 2, 0, 0);
+    }
+    // movsd [r12 + slot], xmm0
+    at = jit_put(at, "\xF2\x41\x0F\x11\x84\x24", 6, height * sizeof(double), 4);
+    height++;
+  }
+  // movsd xmm0, [r12]; pop r12; ret
+  at = jit_put(at, "\xF2\x41\x0F\x10\x84\x24", 6, 0, 4);
+  at = jit_put(at, "\x41\x5C\xC3", 3, 0, 0);
+
+  const size_t size =
+      ((size_t)(at - start) + pageSize - 1) / pageSize * pageSize;
+  if (mprotect(start, size, PROT_READ | PROT_EXEC) != 0) {
+    return;
+  }
+  program->native = (double (*)(double*))(uintptr_t)start;
+  program->nativeSize = size;
+  program->block = block;
+  block->used += size;
+}
+#else
+/**
+ * jit_compile()
+ * ----------------
+ * Native code is only generated for x86-64 Linux, so elsewhere every program
+ *is left to the interpreter.
+ *
+ * program: The program to translate.
+ *
+ * Returns: void
+ *
+ **/
+void jit_compile(Program* program) {
+  (void)program;
+}
+#endif
+
+/**
+ * program_lower()
+ * ----------------
+ * Lowers a compiled expression for the selected backend. Native code is only
+ *generated once the program is hot (see program_warm()). Memo nodes are kept
+ *as calls, but a subexpression that becomes shared after an expression was
+ *lowered is still computed inline by its program, which gives the same value.
+ *
+ * expr: The compiled expression, or NULL if it failed to compile.
+ * arena: The arena to allocate the program from.
+ *
+ * Returns: The program, or NULL if the tree backend is selected, te_layout_ok()
+ *fails or the expression cannot be lowered, in which case it is evaluated by
+ *tinyexpr.
+ *
+ **/
+Program* program_lower(const te_expr* expr, Arena* arena) {
+  if (evalBackend == BACKEND_TREE || expr == NULL || !te_layout_ok()) {
+    return NULL;
+  }
+  if (!operatorsFound) {
+    program_find_operators();
+  }
+  lowerLength = 0;
+  if (program_emit(expr, 0, 0) == 0) {
+    return NULL;
+  }
+
+  stats_allocation();
+  Program* program = arena_alloc(arena, sizeof(Program));
+  Instruction* code = arena_alloc(arena, lowerLength * sizeof(Instruction));
+  memcpy(code, lowerCode, lowerLength * sizeof(Instruction));
+  program->code = code;
+  program->length = lowerLength;
+  program->evaluations = 0;
+  program->native = NULL;
+  program->nativeSize = 0;
+  program->block = NULL;
+  return program;
+}
+
+/**
+ * program_warm()
+ * ----------------
+ * Counts evaluations of a program that are about to happen, and translates it
+ *to native code when the jit backend is selected and the count first reaches
+ *JIT_HOT_EVALUATIONS, so that expressions evaluated only a few times are not
+ *worth the cost of mapping code for. Must only be called by the main thread
+ *while no worker is evaluating.
+ *
+ * program: The program, or NULL.
+ * evaluations: The number of evaluations about to happen.
+ *
+ * Returns: void
+ *
+ **/
+void program_warm(Program* program, long evaluations) {
+  if (evalBackend != BACKEND_JIT || program == NULL) {
+    return;
+  }
+  const long before = program->evaluations;
+  program->evaluations += evaluations;
+  if (before < JIT_HOT_EVALUATIONS &&
+      program->evaluations >= JIT_HOT_EVALUATIONS) {
+    jit_compile(program);
+  }
+}
+
+/**
+ * program_free()
+ * ----------------
+ * Gives back the native code of a program if it was the last code written to
+ *its block, as it is for an @range expression. Any other code is released by
+ *jit_reset(), and the rest of the program with the arena it was allocated
+ *from.
+ *
+ * program: The program, or NULL.
+ *
+ * Returns: void
+ *
+ **/
+void program_free(const Program* program) {
+  if (program == NULL || program->native == NULL || program->block == NULL) {
+    return;
+  }
+  JitBlock* block = program->block;
+  const unsigned char* code =
+      (const unsigned char*)(uintptr_t)program->native;
+  if (code + program->nativeSize == block->code + block->used) {
+    block->used -= program->nativeSize;
+  }
+}
+
+/**
+ * jit_reset()
+ * ----------------
+ * Unmaps all native code. Called when the expression cache is cleared, as
+ *cached programs are what run it.
+ *
+ * Returns: void
+ *
+ **/
+void jit_reset(void) {
+  while (jitBlocks != NULL) {
+    JitBlock* next = jitBlocks->next;
+    munmap(jitBlocks->code, jitBlocks->size);
+    free(jitBlocks);
+    jitBlocks = next;
+  }
+}
+
+/**
+ * program_call()
+ * ----------------
+ * Calls the function of an instruction in the same way as te_eval().
+ *
+ * instruction: An OP_FUNCTION or OP_CLOSURE instruction.
+ * args: The arguments, which are the top values of the stack.
+ *
+ * Returns: The result of the function.
+ *
+ **/
+double program_call(const Instruction* instruction, const double* args) {
+  const TeFunction function = instruction->operand.function;
+  void* const context = instruction->context;
+  const double* a = args;
+
+  if (instruction->op == OP_CLOSURE) {
+    switch (instruction->arity) {
+      case 0:
+        return ((double (*)(void*))function)(context);
+      case 1:
+        return ((double (*)(void*, double))function)(context, a[0]);
+      case 2:
+        return ((double (*)(void*, double, double))function)(context, a[0],
+                                                               a[1]);
+      case 3:
+        return ((double (*)(void*, double, double, double))function)(
+            context, a[0], a[1], a[2]);
+      case 4:
+        return ((double (*)(void*, double, double, double, double))function)(
+            context, a[0], a[1], a[2], a[3]);
+      case 5:
+        return ((double (*)(void*, double, double, double, double,
+                            double))function)(context, a[0], a[1], a[2], a[3],
+                                              a[4]);
+      case 6:
+        return ((double (*)(void*, double, double, double, double, double,
+                            double))function)(context, a[0], a[1], a[2], a[3],
+                                              a[4], a[5]);
+      default:
+        return ((double (*)(void*, double, double, double, double, double,
+                            double, double))function)(
+            context, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    }
+  }
+
+  switch (instruction->arity) {
+    case 0:
+      return ((double (*)(void))function)();
+    case 3:
+      return ((double (*)(double, double, double))function)(a[0], a[1], a[2]);
+    case 4:
+      return ((double (*)(double, double, double, double))function)(
+          a[0], a[1], a[2], a[3]);
+    case 5:
+      return ((double (*)(double, double, double, double, double))function)(
+          a[0], a[1], a[2], a[3], a[4]);
+    case 6:
+      return ((double (*)(double, double, double, double, double,
+                          double))function)(a[0], a[1], a[2], a[3], a[4],
+                                            a[5]);
+    default:
+      return ((double (*)(double, double, double, double, double, double,
+                          double))function)(a[0], a[1], a[2], a[3], a[4],
+                                            a[5], a[6]);
+  }
+}
+
+/**
+ * program_eval()
+ * ----------------
+ * Evaluates a program, running its native code if it has any. Only reads the
+ *program, so it is safe to call from several threads at once.
+ *
+ * program: The program to evaluate.
+ *
+ * Returns: The value of the expression the program was lowered from.
+ *
+ **/
+double program_eval(const Program* program) {
+  double stack[BYTECODE_STACK_SIZE];
+  if (program->native != NULL) {
+    return program->native(stack);
+  }
+
+  double* top = stack;
+  const Instruction* end = program->code + program->length;
+  for (const Instruction* instruction = program->code; instruction < end;
+       ++instruction) {
+    switch (instruction->op) {
+      case OP_CONSTANT:
+        *top++ = instruction->operand.value;
+        break;
+      case OP_VARIABLE:
+        *top++ = *instruction->operand.bound;
+        break;
+      case OP_CALL1:
+        top[-1] =
+            ((double (*)(double))instruction->operand.function)(top[-1]);
+        break;
+      case OP_CALL2:
+        top--;
+        top[-1] = ((double (*)(double, double))instruction->operand.function)(
+            top[-1], top[0]);
+        break;
+      case OP_ADD:
+        top--;
+        top[-1] = top[-1] + top[0];
+        break;
+      case OP_SUBTRACT:
+        top--;
+        top[-1] = top[-1] - top[0];
+        break;
+      case OP_MULTIPLY:
+        top--;
+        top[-1] = top[-1] * top[0];
+        break;
+      case OP_DIVIDE:
+        top--;
+        top[-1] = top[-1] / top[0];
+        break;
+      case OP_NEGATE:
+        top[-1] = -top[-1];
+        break;
+      case OP_ADD_CONSTANT:
+        top[-1] = top[-1] + instruction->operand.value;
+        break;
+      case OP_SUBTRACT_CONSTANT:
+        top[-1] = top[-1] - instruction->operand.value;
+        break;
+      case OP_MULTIPLY_CONSTANT:
+        top[-1] = top[-1] * instruction->operand.value;
+        break;
+      case OP_DIVIDE_CONSTANT:
+        top[-1] = top[-1] / instruction->operand.value;
+        break;
+      case OP_ADD_VARIABLE:
+        top[-1] = top[-1] + *instruction->operand.bound;
+        break;
+      case OP_SUBTRACT_VARIABLE:
+        top[-1] = top[-1] - *instruction->operand.bound;
+        break;
+      case OP_MULTIPLY_VARIABLE:
+        top[-1] = top[-1] * *instruction->operand.bound;
+        break;
+      case OP_DIVIDE_VARIABLE:
+        top[-1] = top[-1] / *instruction->operand.bound;
+        break;
+      default:
+        top -= instruction->arity;
+        *top = program_call(instruction, top);
+        top++;
+        break;
+    }
+  }
+  return stack[0];
+}
+
+/**
+ * block_fill()
+ * ----------------
+ * Sets every lane of a block column to one value.
+ *
+ * lanes: The column to fill.
+ * value: The value to fill it with.
+ * rows: The number of rows in the block.
+ *
+ * Returns: void
+ *
+ **/
+void block_fill(double* lanes, double value, int rows) {
+  for (int i = 0; i < rows; ++i) {
+    lanes[i] = value;
+  }
+}
+
+/**
+ * block_lanes()
+ * ----------------
+ * Finds the values a variable takes in each row of a block. A Def bound to a
+ *column of the table takes the values in that column; any other variable has
+ *the same value in every row.
+ *
+ * block: The block of the table.
+ * bound: The address the variable is bound to.
+ * scratch: A column to fill when the variable is not bound to a column.
+ *
+ * Returns: The values of the variable, one for each row.
+ *
+ **/
+const double* block_lanes(const TableBlock* block, const double* bound,
+                          double* scratch) {
+  for (int i = 0; i < block->columnCount; ++i) {
+    if (block->bindings[i] == bound) {
+      return block->columns + i * TABLE_BLOCK_SIZE;
+    }
+  }
+  block_fill(scratch, *bound, block->rowCount);
+  return scratch;
+}
+
+/**
+ * block_arithmetic()
+ * ----------------
+ * Applies one of the four arithmetic operators down two columns.
+ *
+ * kind: 0 to add, 1 to subtract, 2 to multiply or 3 to divide, in the
+ *order of OP_ADD to OP_DIVIDE.
+ * left: The left operands, which are replaced by the results.
+ * right: The right operands.
+ * rows: The number of rows in the block.
+ *
+ * Returns: void
+ *
+ **/
+void block_arithmetic(int kind, double* restrict left,
+                      const double* restrict right, int rows) {
+  switch (kind) {
+    case 0:
+      for (int i = 0; i < rows; ++i) {
+        left[i] = left[i] + right[i];
+      }
+      break;
+    case 1:
+      for (int i = 0; i < rows; ++i) {
+        left[i] = left[i] - right[i];
+      }
+      break;
+    case 2:
+      for (int i = 0; i < rows; ++i) {
+        left[i] = left[i] * right[i];
+      }
+      break;
+    default:
+      for (int i = 0; i < rows; ++i) {
+        left[i] = left[i] / right[i];
+      }
+      break;
+  }
+}
+
+/**
+ * program_eval_block()
+ * ----------------
+ * Evaluates a program for every row of a block of a table. Each instruction
+ *is dispatched once for the whole block and runs down a column of values, so
+ *the arithmetic is done a vector at a time. Gives exactly the results
+ *program_eval() would give row by row.
+ *
+ * program: The program to evaluate.
+ * block: The block of the table.
+ * results: Where to store the result for each row.
+ *
+ * Returns: void
+ *
+ **/
+void program_eval_block(const Program* program, const TableBlock* block,
+                        double* results) {
+  double stack[BYTECODE_STACK_SIZE][TABLE_BLOCK_SIZE];
+  double scratch[TABLE_BLOCK_SIZE];
+  double args[TE_ARITY_MASK];
+  const int rows = block->rowCount;
+  int height = 0;
+
+  const Instruction* end = program->code + program->length;
+  for (const Instruction* instruction = program->code; instruction < end;
+       ++instruction) {
+    const int op = instruction->op;
+    switch (op) {
+      case OP_CONSTANT:
+        block_fill(stack[height++], instruction->operand.value, rows);
+        break;
+      case OP_VARIABLE:
+        memcpy(stack[height++],
+               block_lanes(block, instruction->operand.bound, scratch),
+               rows * sizeof(double));
+        break;
+      case OP_CALL1: {
+        double (*function)(double) =
+            (double (*)(double))instruction->operand.function;
+        double* top = stack[height - 1];
+        for (int i = 0; i < rows; ++i) {
+          top[i] = function(top[i]);
+        }
+        break;
+      }
+      case OP_CALL2: {
+        double (*function)(double, double) =
+            (double (*)(double, double))instruction->operand.function;
+        height--;
+        double* left = stack[height - 1];
+        const double* right = stack[height];
+        for (int i = 0; i < rows; ++i) {
+          left[i] = function(left[i], right[i]);
+        }
+        break;
+      }
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+        height--;
+        block_arithmetic(op - OP_ADD, stack[height - 1], stack[height], rows);
+        break;
+      case OP_NEGATE:
+        for (int i = 0; i < rows; ++i) {
+          stack[height - 1][i] = -stack[height - 1][i];
+        }
+        break;
+      case OP_ADD_CONSTANT:
+      case OP_SUBTRACT_CONSTANT:
+      case OP_MULTIPLY_CONSTANT:
+      case OP_DIVIDE_CONSTANT:
+        block_fill(scratch, instruction->operand.value, rows);
+        block_arithmetic(op - OP_ADD_CONSTANT, stack[height - 1], scratch,
+                         rows);
+        break;
+      case OP_ADD_VARIABLE:
+      case OP_SUBTRACT_VARIABLE:
+      case OP_MULTIPLY_VARIABLE:
+      case OP_DIVIDE_VARIABLE:
+        block_arithmetic(
+            op - OP_ADD_VARIABLE, stack[height - 1],
+            block_lanes(block, instruction->operand.bound, scratch), rows);
+        break;
+      default:
+        // Each row's arguments are read before its result overwrites the
+        // first of them
+        height -= instruction->arity;
+        for (int i = 0; i < rows; ++i) {
+          for (int j = 0; j < instruction->arity; ++j) {
+            args[j] = stack[height + j][i];
+          }
+          stack[height][i] = program_call(instruction, args);
+        }
+        height++;
+        break;
+    }
+  }
+  memcpy(results, stack[0], rows * sizeof(double));
+}
+
+/**
+ * block_evaluate()
+ * ----------------
+ * Evaluates an expression for every row of a block, with its program if it
+ *has one. Otherwise tinyexpr evaluates it a row at a time, reading the values
+ *of the row from the variables bound to the columns of the block, which are
+ *left holding those of the last row.
+ *
+ * block: The block.
+ * expr: The compiled expression.
+ * program: expr lowered for the selected backend, or NULL.
+ * results: Where to store the result for each row.
+ *
+ * Returns: void
+ *
+ **/
+void block_evaluate(const TableBlock* block, const te_expr* expr,
+                    const Program* program, double* results) {
+  if (program != NULL) {
+    program_eval_block(program, block, results);
+    return;
+  }
+  for (int i = 0; i < block->rowCount; ++i) {
+    for (int j = 0; j < block->columnCount; ++j) {
+      *block->bindings[j] = block->columns[j * TABLE_BLOCK_SIZE + i];
+    }
+    results[i] = te_eval(expr);
+  }
+}
+
+/**
+ * cache_eval()
+ * ----------------
+ * Evaluates a cached expression with its program, or with tinyexpr if it has
+ *none.
+ *
+ * entry: The cache entry.
+ *
+ * Returns: The value of the expression, or NAN if it failed to compile.
+ *
+ **/
+double cache_eval(const CacheEntry* entry) {
+  if (entry->program != NULL) {
+    return program_eval(entry->program);
+  }
+  return entry->compiled ? te_eval(entry->compiled) : NAN;
+}
+
+/**
+ * expr_cache_clear()
+ * ----------------
+ * Frees every compiled expression held in the expression cache. Must be called
+ *whenever a Def is added, as this can move the Def values that compiled
+ *expressions are bound to, or give meaning to a name that previously failed to
+ *compile.
+ *
+ * Returns: void
+ *
+ **/
+void expr_cache_clear(void) {
+  if (exprCacheSize == 0) {
+    return;
+  }
+  for (int i = 0; i < EXPR_CACHE_BUCKETS; ++i) {
+    CacheEntry* entry = exprCache[i];
+    while (entry != NULL) {
+      te_free(entry->compiled);
+      entry = entry->next;
+    }
+    exprCache[i] = NULL;
+  }
+  exprCacheSize = 0;
+  jit_reset();
+  memo_clear();
+  arena_reset(&cacheArena);
+}
+
+/**
+ * expr_cache_find()
+ * ----------------
+ * Looks up an expression in the expression cache. The cache is only changed by
+ *the main thread, so lookups may run on several threads while no line is being
+ *handled.
+ *
+ * expression: Null-terminated string representing the expression.
+ * bucket: The cache bucket of expression.
+ *
+ * Returns: The cache entry for expression, or NULL if it is not cached.
+ *
+ **/
+const CacheEntry* expr_cache_find(const char* expression, unsigned int bucket) {
+  for (const CacheEntry* entry = exprCache[bucket]; entry != NULL;
+       entry = entry->next) {
+    if (strcmp(entry->expression, expression) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * expr_cache_insert()
+ * ----------------
+ * Adds a compiled expression to the expression cache, which then owns it,
+ *starting over if the cache has grown too large. The expression is lowered
+ *for the selected backend. If the expression is already cached, the new copy
+ *is freed instead.
+ *
+ * expression: Null-terminated string representing the expression.
+ * compiled: The compiled expression, or NULL if it failed to compile.
+ *
+ * Returns: The cache entry for expression.
+ *
+ **/
+const CacheEntry* expr_cache_insert(const char* expression,
+                                    te_expr* compiled) {
+  const unsigned int bucket = hash_string(expression) % EXPR_CACHE_BUCKETS;
+  const CacheEntry* existing = expr_cache_find(expression, bucket);
+  if (existing != NULL) {
+    te_free(compiled);
+    return existing;
+  }
+
+  if (exprCacheSize >= EXPR_CACHE_MAX_ENTRIES) {
+    expr_cache_clear();
+  }
+  CacheEntry* entry = arena_alloc(&cacheArena, sizeof(CacheEntry));
+  entry->expression =
+      arena_strndup(&cacheArena, expression, strlen(expression));
+  entry->compiled = compiled;
+  entry->program = program_lower(compiled, &cacheArena);
+  entry->next = exprCache[bucket];
+  exprCache[bucket] = entry;
+  exprCacheSize++;
+  return entry;
+}
+
+/**
+ * update_bindings()
+ * ----------------
+ * Brings the persistent tinyexpr bindings up to date with the Def array. Only
+ *Defs added since the last update are bound, unless the array has moved, in
+ *which case every address is rebound.
+ *
+ * defs: The array of defined variables.
+ * defSize: The number of defined variables.
+ *
+ * Returns: void
+ *
+ **/
+void update_bindings(const Def* defs, int defSize) {
+  if (defs != teVarsDefs) {
+    teVarsDefs = defs;
+    teVarsSize = 0;
+  }
+
+  if (defSize > teVarsCapacity) {
+    teVarsCapacity = defCapacity;
+    teVars = realloc(teVars, teVarsCapacity * sizeof(te_variable));
+  }
+
+  for (; teVarsSize < defSize; teVarsSize++) {
+    teVars[teVarsSize].name = defs[teVarsSize].name;
+    teVars[teVarsSize].address = &defs[teVarsSize].value;
+    teVars[teVarsSize].type = TE_VARIABLE;
+    teVars[teVarsSize].context = NULL;
+  }
+}
+
+/**
+ * push_binding()
+ * ----------------
+ * Appends a binding to an array of bindings, growing it as needed.
+ *
+ * vars: Pointer to the array of bindings.
+ * capacity: Pointer to the allocated length of the array.
+ * count: The number of bindings already in the array.
+ * binding: The binding to append.
+ *
+ * Returns: The new number of bindings in the array.
+ *
+ **/
+int push_binding(te_variable** vars, int* capacity, int count,
+                 te_variable binding) {
+  if (count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : ARRAY_MIN_CAPACITY;
+    *vars = realloc(*vars, *capacity * sizeof(te_variable));
+  }
+  (*vars)[count] = binding;
+  return count + 1;
+}
+
+/**
+ * next_name()
+ * ----------------
+ * Finds the next name in an expression, splitting names out the same way
+ *tinyexpr reads them. Numbers are skipped whole, so "2e3" holds no name.
+ *
+ * next: Pointer to the position to search from, which is moved past the name.
+ * length: Pointer to where the length of the name is stored.
+ *
+ * Returns: A pointer to the start of the name, or NULL if there are no more.
+ *
+ **/
+const char* next_name(const char** next, size_t* length) {
+  const char* text = *next;
+
+  while (*text != '\0') {
+    if (isdigit(*text) || *text == '.') {
+      char* end;
+      strtod(text, &end);
+      text = (end > text) ? end : text + 1;
+    } else if (isalpha(*text)) {
+      const char* start = text;
+      while (isalpha(*text) || isdigit(*text) || *text == '_') {
+        text++;
+      }
+      *next = text;
+      *length = text - start;
+      return start;
+    } else {
+      text++;
+    }
+  }
+  *next = text;
+  return NULL;
+}
+
+/**
+ * symbol_lookup_name()
+ * ----------------
+ * Finds the Def or Loop with a name that is not null-terminated.
+ *
+ * name: The name to look up.
+ * length: The number of characters in name.
+ *
+ * Returns: The symbol for name, or NULL if there is no variable with that name.
+ *
+ **/
+Symbol* symbol_lookup_name(const char* name, size_t length) {
+  if (length > VARIABLE_NAME_MAX) {
+    return NULL;
+  }
+  char copy[VARIABLE_NAME_SIZE];
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+  return symbol_lookup(copy);
+}
+
+/**
+ * select_bindings()
+ * ----------------
+ * Collects the bindings of every Def named in an expression, so that compiling
+ *the expression does not depend on the number of Defs. Only reads shared
+ *state, so it is safe to call from several threads at once.
+ *
+ * expression: Null-terminated string representing the expression.
+ * vars: Pointer to the array to store the bindings in, such as exprVars.
+ * capacity: Pointer to the allocated length of that array.
+ *
+ * Returns: The number of bindings stored in the array.
+ *
+ **/
+int select_bindings(const char* expression, te_variable** vars,
+                    int* capacity) {
+  int count = 0;
+  const char* next = expression;
+  const char* name;
+  size_t length;
+
+  while ((name = next_name(&next, &length)) != NULL) {
+    const Symbol* symbol = symbol_lookup_name(name, length);
+    if (symbol != NULL && symbol->isLoop == 0) {
+      count = push_binding(vars, capacity, count, teVars[symbol->index]);
+    }
+  }
+  return count;
+}
+
+/**
+ * tiny_expr()
+ * ----------------
+ * Evaluates a mathematical expression using tinyexpr, allowing for variable
+ *substitutions. Compiled expressions are kept in the expression cache so that
+ *repeated expressions are only parsed once, and are compiled against only the
+ *Defs they name.
+ *
+ * expression: Null-terminated string representing the mathematical expression
+ *to evaluate. defs: Pointer to the array of defined variables. defSize: Pointer
+ *to the number of defined variables.
+ *
+ * Returns: The computed result of the expression. If evaluation fails, returns
+ *NAN.
+ *
+ * Errors: If the expression is invalid, returns NAN.
+ *
+ *21/3/25 11:30
+ **/
+double tiny_expr(const char* expression, Def** defs, const int* defSize) {
+  // Reuse the compiled expression if this exact text has been seen before
+  const unsigned int bucket = hash_string(expression) % EXPR_CACHE_BUCKETS;
+  const CacheEntry* cached = expr_cache_find(expression, bucket);
+  if (cached != NULL) {
+    stats_begin(STAGE_EVAL);
+    program_warm(cached->program, 1);
+    const double result = cache_eval(cached);
+    stats_end(1);
+    return result;
+  }
+
+  // Initialise result, default to NAN if invalid input
+  double result = NAN;
+
+  // Make room in the cache first, as the new expression may share memoised
+  // subexpressions with what is already cached
+  if (exprCacheSize >= EXPR_CACHE_MAX_ENTRIES) {
+    expr_cache_clear();
+  }
+
+  // Bind any new defs, then pick out the ones this expression uses
+  // tiny_expr() 21/3/25 14:07
+  stats_begin(STAGE_COMPILE);
+  update_bindings(*defs, *defSize);
+  const int varCount =
+      select_bindings(expression, &exprVars, &exprVarsCapacity);
+
+  int errPos;
+  // Parse and compile the expression using defs
+  te_expr* expr = te_compile(expression, exprVars, varCount, &errPos);
+  if (expr) {
+    memo_rewrite(expr);
+  }
+
+  // Keep the expression (or its failure to compile) for next time
+  const CacheEntry* entry = expr_cache_insert(expression, expr);
+  stats_end(1);
+
+  if (expr) {
+    stats_begin(STAGE_EVAL);
+    program_warm(entry->program, 1);
+    result = cache_eval(entry);
+    stats_end(1);
+  }
+
+  return result;
+}
+
+/**
+ * expression_handler()
+ * ----------------
+ * Processes an expression by evaluating it and printing the result if valid.
+ *
+ * strippedLine: Null-terminated string containing the expression to evaluate.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * sigFigures: Number of significant figures to use when printing the result.
+ *
+ * Returns: void
+ *
+ * Errors: If the expression is invalid, prints an error message to stderr.
+ *
+ **/
+void expression_handler(char strippedLine[], Def** defs, const int* defSize,
+                        const int sigFigures) {
+  const double result = tiny_expr(strippedLine, defs, defSize);
+  if (isnan(result)) {
+    report_error();
+    return;
+  }
+  print_expression(result, sigFigures);
+}
+
+/**
+ * reactive_grow()
+ * ----------------
+ * Makes room in reactive mode state for every Def.
+ *
+ * defSize: The number of defined variables.
+ *
+ * Returns: void
+ *
+ **/
+void reactive_grow(int defSize) {
+  if (defSize <= formulasCapacity) {
+    return;
+  }
+  const int capacity = (defCapacity > defSize) ? defCapacity : defSize;
+  formulas = realloc(formulas, capacity * sizeof(Formula));
+  memset(formulas + formulasCapacity, 0,
+         (capacity - formulasCapacity) * sizeof(Formula));
+  formulasCapacity = capacity;
+  reactiveOrder = realloc(reactiveOrder, capacity * sizeof(int));
+  reactiveStack = realloc(reactiveStack, 2 * capacity * sizeof(int));
+}
+
+/**
+ * reactive_walk()
+ * ----------------
+ * Walks depth first through the dependents of the Def at the bottom of
+ *reactiveStack, appending each Def once all of its dependents are done.
+ *
+ * count: The number of Defs already in reactiveOrder.
+ *
+ * Returns: The number of Defs in reactiveOrder afterwards.
+ *
+ **/
+int reactive_walk(int count) {
+  int depth = 1;
+
+  // Each level of the stack holds a Def and the next dependent to look at
+  while (depth > 0) {
+    int* top = &reactiveStack[2 * (depth - 1)];
+    const Formula* formula = &formulas[top[0]];
+    if (top[1] < formula->dependentCount) {
+      const int next = formula->dependents[top[1]++];
+      if (formulas[next].visited != propagation) {
+        formulas[next].visited = propagation;
+        reactiveStack[2 * depth] = next;
+        reactiveStack[2 * depth + 1] = 0;
+        depth++;
+      }
+    } else {
+      reactiveOrder[count++] = top[0];
+      depth--;
+    }
+  }
+  return count;
+}
+
+/**
+ * reactive_search()
+ * ----------------
+ * Finds every Def that depends on any of a set of Defs, directly or through
+ *other formulas, without recursing. Each Def found is marked as visited by a
+ *new propagation.
+ *
+ * from: The indices of the Defs to start from.
+ * fromCount: The number of Defs in from.
+ *
+ * Returns: The number of Defs found, including those in from, which are
+ *stored in reactiveOrder in reverse topological order.
+ *
+ **/
+int reactive_search(const int* from, int fromCount) {
+  int count = 0;
+  propagation++;
+  for (int i = 0; i < fromCount; ++i) {
+    // Defs past the end of formulas have never been read by a formula
+    if (from[i] >= formulasCapacity ||
+        formulas[from[i]].visited == propagation) {
+      continue;
+    }
+    formulas[from[i]].visited = propagation;
+    reactiveStack[0] = from[i];
+    reactiveStack[1] = 0;
+    count = reactive_walk(count);
+  }
+  return count;
+}
+
+/**
+ * reactive_forget()
+ * ----------------
+ * Drops the formula of a Def, so that it holds a plain value.
+ *
+ * index: The index of the Def.
+ *
+ * Returns: void
+ *
+ **/
+void reactive_forget(int index) {
+  Formula* formula = &formulas[index];
+  for (int i = 0; i < formula->inputCount; ++i) {
+    Formula* input = &formulas[formula->inputs[i]];
+    for (int j = 0; j < input->dependentCount; ++j) {
+      if (input->dependents[j] == index) {
+        input->dependents[j] = input->dependents[--input->dependentCount];
+        break;
+      }
+    }
+  }
+  free(formula->expression);
+  free(formula->inputs);
+  formula->expression = NULL;
+  formula->inputs = NULL;
+  formula->inputCount = 0;
+}
+
+/**
+ * reactive_record()
+ * ----------------
+ * Remembers the expression a Def was assigned in reactive mode, replacing its
+ *previous formula. An expression that reads the Def itself, or a Def that
+ *depends on it, would make a cycle, so the Def then holds a plain value; this
+ *is how "a = a + 1" keeps its usual meaning.
+ *
+ * name: The name of the variable that was assigned.
+ * expression: Null-terminated stripped expression it was assigned.
+ * defSize: The number of defined variables.
+ *
+ * Returns: void
+ *
+ **/
+void reactive_record(const char* name, const char* expression, int defSize) {
+  const Symbol* symbol = symbol_lookup(name);
+  if (symbol == NULL || symbol->isLoop) {
+    return;
+  }
+  const int index = symbol->index;
+  reactive_grow(defSize);
+  reactive_forget(index);
+
+  // Collect each Def the expression reads once
+  int* inputs = NULL;
+  int inputCount = 0;
+  int inputCapacity = 0;
+  const char* next = expression;
+  const char* inputName;
+  size_t length;
+  while ((inputName = next_name(&next, &length)) != NULL) {
+    const Symbol* input = symbol_lookup_name(inputName, length);
+    if (input == NULL || input->isLoop) {
+      continue;
+    }
+    int seen = 0;
+    for (int i = 0; i < inputCount && !seen; ++i) {
+      seen = inputs[i] == input->index;
+    }
+    if (!seen) {
+      if (inputCount == inputCapacity) {
+        inputCapacity = inputCapacity ? inputCapacity * 2 : ARRAY_MIN_CAPACITY;
+        inputs = realloc(inputs, inputCapacity * sizeof(int));
+      }
+      inputs[inputCount++] = input->index;
+    }
+  }
+
+  reactive_search(&index, 1);
+  for (int i = 0; i < inputCount; ++i) {
+    if (formulas[inputs[i]].visited == propagation) {
+      free(inputs);
+      return;
+    }
+  }
+
+  Formula* formula = &formulas[index];
+  formula->expression = malloc(strlen(expression) + 1);
+  strcpy(formula->expression, expression);
+  formula->inputs = inputs;
+  formula->inputCount = inputCount;
+  for (int i = 0; i < inputCount; ++i) {
+    Formula* input = &formulas[inputs[i]];
+    if (input->dependentCount == input->dependentCapacity) {
+      input->dependentCapacity = input->dependentCapacity
+                                     ? input->dependentCapacity * 2
+                                     : ARRAY_MIN_CAPACITY;
+      input->dependents =
+          realloc(input->dependents, input->dependentCapacity * sizeof(int));
+    }
+    input->dependents[input->dependentCount++] = index;
+  }
+}
+
+/**
+ * reactive_propagate()
+ * ----------------
+ * Recomputes the Defs that depend on a set of Defs whose values have just
+ *changed, in topological order, so each formula is evaluated at most once and
+ *only after everything it reads. A formula is only evaluated if one of its
+ *inputs changed value, and each Def whose value changes is printed like an
+ *assignment. The changed Defs themselves are never recomputed.
+ *
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * changed: The indices of the Defs that changed.
+ * changedCount: The number of Defs in changed.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: Prints an error message to stderr for every formula that no longer
+ *has a valid value, which leaves that Def unchanged.
+ *
+ **/
+void reactive_propagate(Def** defs, int* defSize, const int* changed,
+                        int changedCount, int sigFigures) {
+  int dependents = 0;
+  for (int i = 0; i < changedCount; ++i) {
+    if (changed[i] < formulasCapacity) {
+      dependents += formulas[changed[i]].dependentCount;
+    }
+  }
+  if (dependents == 0) {
+    return;
+  }
+  const int count = reactive_search(changed, changedCount);
+  for (int i = 0; i < changedCount; ++i) {
+    if (changed[i] < formulasCapacity) {
+      formulas[changed[i]].changed = propagation;
+    }
+  }
+
+  reactivePropagating = 1;
+  for (int i = count - 1; i >= 0; --i) {
+    const int target = reactiveOrder[i];
+    Formula* formula = &formulas[target];
+    if (formula->changed == propagation) {
+      continue;
+    }
+    int stale = 0;
+    for (int j = 0; j < formula->inputCount && !stale; ++j) {
+      stale = formulas[formula->inputs[j]].changed == propagation;
+    }
+    if (!stale) {
+      continue;
+    }
+
+    const double value = tiny_expr(formula->expression, defs, defSize);
+    if (isnan(value)) {
+      report_error();
+      continue;
+    }
+    if (memcmp(&(*defs)[target].value, &value, sizeof(double)) != 0) {
+      formula->changed = propagation;
+      handle_new_variable(defs, defSize, (*defs)[target].name, value,
+                          sigFigures);
+    }
+  }
+  reactivePropagating = 0;
+}
+
+/**
+ * assignment_handler()
+ * ----------------
+ * Processes an assignment operation, validating variable names and evaluating
+ *the assigned expression. In reactive mode, the expression is remembered so
+ *that the variable follows changes to the Defs it reads.
+ *
+ * name: Null-terminated name of the variable being assigned.
+ * expression: Null-terminated expression whose value is assigned.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * sigFigures: Number of significant figures to use when printing the
+ *assignment.
+ *
+ * Returns: void
+ *
+ * Errors: If the assignment is invalid, prints an error message to stderr.
+ *
+ **/
+void assignment_handler(const char name[], const char expression[],
+                        Def** defs, int* defSize, const int sigFigures) {
+  // check if expression is valid and store it
+  const double result = tiny_expr(expression, defs, defSize);
+  if (isnan(result)) {
+    report_error();
+    return;
+  }
+
+  // check if variable name is allowed
+  if (valid_variable_name(name) == 0) {
+    report_error();
+    return;
+  }
+
+  // If expression is valid and variable name allowed, handle appropriately
+  handle_new_variable(defs, defSize, name, result, sigFigures);
+  if (reactiveEnabled) {
+    reactive_record(name, expression, *defSize);
+  }
+}
+
+/**
+ * range_value()
+ * ----------------
+ * Computes the value of a loop variable at a given iteration. Values are
+ *computed from the start value rather than accumulated, so that any block of
+ *iterations can be computed on its own.
+ *
+ * loop: The loop variable.
+ * step: The iteration, counting from 0.
+ *
+ * Returns: The value of the loop variable at that iteration.
+ *
+ **/
+double range_value(const Loop* loop, long step) {
+  return loop->start + step * loop->increment;
+}
+
+/**
+ * range_steps()
+ * ----------------
+ * Counts the values a loop variable takes from its start to its end value.
+ *
+ * loop: The loop variable, whose values have passed valid_loop_values().
+ *
+ * Returns: The number of iterations of the loop.
+ *
+ **/
+long range_steps(const Loop* loop) {
+  const double quotient = (loop->end - loop->start) / loop->increment;
+  const long steps = (long)floor(quotient);
+
+  // A quotient such as (0.3 - 0.1) / 0.1 rounds to just below a whole number,
+  // so the next value still counts if it is within a few ULPs of the end
+  if (quotient - steps < 0.5) {
+    return steps + 1;
+  }
+  const double scale = fmax(fabs(loop->start), fabs(loop->end));
+  const double tolerance =
+      RANGE_STEP_ULPS * (nextafter(scale, INFINITY) - scale);
+  const double next = range_value(loop, steps + 1);
+  const int reachesEnd = (loop->increment > 0)
+                             ? next <= loop->end + tolerance
+                             : next >= loop->end - tolerance;
+  return steps + (reachesEnd ? 2 : 1);
+}
+
+/**
+ * compile_range()
+ * ----------------
+ * Compiles an expression in which each of several loop variables is bound to
+ *its own loop value, along with any Defs the expression names, and lowers it
+ *for the selected backend.
+ *
+ * expression: Null-terminated string representing the expression.
+ * loops: The loop variables, or NULL to bind only Defs.
+ * loopCount: The number of loop variables.
+ * loopValues: The addresses the loop variables are bound to, in order.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * program: Pointer to where the program is stored, which is allocated from
+ *lineArena and must be passed to program_free(), or NULL if there is none.
+ *
+ * Returns: The compiled expression, which the caller must te_free(), or NULL if
+ *the expression is invalid.
+ *
+ **/
+te_expr* compile_range(const char* expression, const Loop* const* loops,
+                       int loopCount, double* loopValues, Def** defs,
+                       const int* defSize, Program** program) {
+  stats_begin(STAGE_COMPILE);
+  update_bindings(*defs, *defSize);
+  int varCount = select_bindings(expression, &exprVars, &exprVarsCapacity);
+
+  for (int i = 0; i < loopCount; ++i) {
+    te_variable loopBinding = {loops[i]->name, &loopValues[i], TE_VARIABLE,
+                               NULL};
+    varCount =
+        push_binding(&exprVars, &exprVarsCapacity, varCount, loopBinding);
+  }
+
+  int errPos;
+  te_expr* expr = te_compile(expression, exprVars, varCount, &errPos);
+  *program = program_lower(expr, &lineArena);
+  stats_end(1);
+  return expr;
+}
+
+/**
+ * range_evaluate()
+ * ----------------
+ * Evaluates a compiled expression for every value of a loop variable, printing
+ *each result in the format Result = <result> when <var> = <value>. Iterations
+ *are evaluated and printed a block at a time.
+ *
+ * expr: The compiled expression, bound to loopValue.
+ * program: expr lowered for the selected backend, or NULL to evaluate expr
+ *with tinyexpr.
+ * loop: The loop variable.
+ * loopValue: The address the loop variable is bound to.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: Prints an error message to stderr for every iteration whose result
+ *is invalid.
+ *
+ **/
+void range_evaluate(const te_expr* expr, const Program* program,
+                    const Loop* loop, double* loopValue, int sigFigures) {
+  double values[RANGE_BLOCK_SIZE];
+  double results[RANGE_BLOCK_SIZE];
+  const long steps = range_steps(loop);
+
+  for (long first = 0; first < steps; first += RANGE_BLOCK_SIZE) {
+    const int blockSize =
+        (steps - first < RANGE_BLOCK_SIZE) ? steps - first : RANGE_BLOCK_SIZE;
+
+    for (int i = 0; i < blockSize; ++i) {
+      values[i] = range_value(loop, first + i);
+    }
+    stats_begin(STAGE_EVAL);
+    if (program != NULL) {
+      for (int i = 0; i < blockSize; ++i) {
+        *loopValue = values[i];
+        results[i] = program_eval(program);
+      }
+    } else {
+      for (int i = 0; i < blockSize; ++i) {
+        *loopValue = values[i];
+        results[i] = te_eval(expr);
+      }
+    }
+    stats_end(blockSize);
+
+    stats_begin(STAGE_OUTPUT);
+    for (int i = 0; i < blockSize; ++i) {
+      if (isnan(results[i])) {
+        // As records, an error is followed by its point like a result
+        report_error();
+        if (outputFormat != OUTPUT_TEXT) {
+          output_record(RECORD_POINT, loop->name, values[i]);
+        }
+        continue;
+      }
+      output_result(results[i], loop, values[i], sigFigures);
+    }
+    stats_end(blockSize);
+  }
+}
+
+/**
+ * line_starts_with()
+ * ----------------
+ * Checks whether a line begins with the name of a command.
+ *
+ * line: The line, which need not be null-terminated.
+ * length: The number of characters in line.
+ * command: Null-terminated name of the command.
+ *
+ * Returns: 1 if line begins with command, 0 otherwise.
+ *
+ **/
+int line_starts_with(const char line[], size_t length, const char* command) {
+  const size_t commandLength = strlen(command);
+  return length >= commandLength && memcmp(line, command, commandLength) == 0;
+}
+
+/**
+ * line_sweeps()
+ * ----------------
+ * Checks whether a line begins with the name of one of the sweep commands.
+ *
+ * line: The line, which need not be null-terminated.
+ * length: The number of characters in line.
+ *
+ * Returns: 1 if line begins with a sweep command, 0 otherwise.
+ *
+ **/
+int line_sweeps(const char line[], size_t length) {
+  for (int i = 0; i < REDUCE_COUNT; ++i) {
+    if (line_starts_with(line, length, sweepCommands[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * scan_line()
+ * ----------------
+ * Copies a line with every whitespace character removed and classifies it, in
+ *a single pass. Runs of characters that are neither whitespace, '=' nor null
+ *are copied a vector at a time where SSE2 is available. Lines are classified
+ *as line_dispatch() expects: blank lines and comments, then the commands
+ *beginning with '@', then by the number of '=' after the first stripped
+ *character. An assignment is split at its '=', skipping a leading '=' as
+ *strtok() would.
+ *
+ * line: The line to scan, which need not be null-terminated.
+ * length: The number of characters in line.
+ * stripped: Buffer of at least length + 1 characters to copy into.
+ * scan: Where to store the description of the line.
+ *
+ * Returns: void
+ *
+ **/
+void scan_line(const char line[], size_t length, char stripped[],
+               LineScan* scan) {
+  size_t read = 0;
+  size_t write = 0;
+  size_t equalsCount = 0;
+  size_t equalsIndex = 0;
+
+  while (read < length) {
+#ifdef __SSE2__
+    if (read + LEXER_CHUNK_SIZE <= length) {
+      // Find the first whitespace ('\t' to '\r' or ' '), '=' or null
+      const __m128i chunk = _mm_loadu_si128((const __m128i*)(line + read));
+      const __m128i control =
+          _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('\t' - 1)),
+                        _mm_cmplt_epi8(chunk, _mm_set1_epi8('\r' + 1)));
+      const __m128i special = _mm_or_si128(
+          _mm_or_si128(control, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '))),
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('=')),
+                       _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+      const int mask = _mm_movemask_epi8(special);
+
+      // Everything before that character is copied as is. stripped never
+      // runs ahead of line, so the whole chunk always fits
+      _mm_storeu_si128((__m128i*)(stripped + write), chunk);
+      const int plain = mask ? __builtin_ctz(mask) : LEXER_CHUNK_SIZE;
+      read += plain;
+      write += plain;
+      if (plain == LEXER_CHUNK_SIZE) {
+        continue;
+      }
+    }
+#endif
+    const char c = line[read];
+    if (c == '\0') {
+      break;
+    }
+    if (c != ' ' && (c < '\t' || c > '\r')) {
+      if (c == '=' && write > 0 && equalsCount++ == 0) {
+        equalsIndex = write;
+      }
+      stripped[write++] = c;
+    }
+    read++;
+  }
+  stripped[write] = '\0';
+  scan->length = read;
+  scan->name = NULL;
+  scan->expression = stripped;
+
+  if (stripped[0] == '#' || stripped[0] == '\0') {
+    scan->kind = LINE_BLANK;
+  } else if (read == strlen(print) && memcmp(line, print, read) == 0) {
+    scan->kind = LINE_PRINT;
+  } else if (line_starts_with(line, read, range)) {
+    scan->kind = LINE_RANGE;
+  } else if (line_starts_with(line, read, save)) {
+    scan->kind = LINE_SAVE;
+  } else if (line_starts_with(line, read, load)) {
+    scan->kind = LINE_LOAD;
+  } else if (line_starts_with(line, read, csv)) {
+    scan->kind = LINE_CSV;
+  } else if (line_starts_with(line, read, binary)) {
+    scan->kind = LINE_BINARY;
+  } else if (line_sweeps(line, read)) {
+    scan->kind = LINE_SWEEP;
+  } else if (equalsCount == 0) {
+    scan->kind = LINE_EXPRESSION;
+  } else if (equalsCount > 1) {
+    scan->kind = LINE_INVALID;
+  } else {
+    stripped[equalsIndex] = '\0';
+    scan->name = stripped + (stripped[0] == '=');
+    scan->expression = stripped + equalsIndex + 1;
+    scan->kind = (scan->name[0] == '\0' || scan->expression[0] == '\0')
+                     ? LINE_INVALID
+                     : LINE_ASSIGNMENT;
+  }
+}
+
+/**
+ * command_token()
+ * ----------------
+ * Finds the next argument of a command, which must follow a single space and
+ *be followed by another argument.
+ *
+ * from: The position just after the previous argument.
+ * lineEnd: The end of the line holding the command.
+ * length: Pointer to where the length of the argument is stored.
+ *
+ * Returns: The start of the argument, or NULL if there is none.
+ *
+ **/
+const char* command_token(const char* from, const char* lineEnd,
+                          size_t* length) {
+  if (from == lineEnd || *from != ' ') {
+    return NULL;
+  }
+  const char* token = from + 1;
+  const char* end = token;
+  while (end < lineEnd && !isspace((unsigned char)*end)) {
+    end++;
+  }
+  if (end == token || end == lineEnd || *end != ' ') {
+    return NULL;
+  }
+  *length = end - token;
+  return token;
+}
+
+/**
+ * command_arguments()
+ * ----------------
+ * Splits a command of the form "<command> <args> <expression>" into a fixed
+ *number of arguments, each found by command_token(), and the expression that
+ *follows them. The command and its arguments hold no whitespace, so the
+ *expression with whitespace removed follows them in strippedLine.
+ *
+ * line: The command, with no leading whitespace. It need not be
+ *null-terminated.
+ * length: The number of characters in line.
+ * strippedLine: Null-terminated copy of line with whitespace removed.
+ * commandLength: The number of characters in the command itself.
+ * count: The number of arguments.
+ * arguments: Where the start of each argument is stored.
+ * argumentLengths: Where the length of each argument is stored.
+ *
+ * Returns: The expression within strippedLine, or NULL if an argument is
+ *missing or the expression is empty or holds an assignment.
+ *
+ **/
+char* command_arguments(const char line[], size_t length, char strippedLine[],
+                        size_t commandLength, int count,
+                        const char* arguments[], size_t argumentLengths[]) {
+  const char* lineEnd = line + length;
+  const char* from = line + commandLength;
+  size_t offset = commandLength;
+  for (int i = 0; i < count; ++i) {
+    arguments[i] = command_token(from, lineEnd, &argumentLengths[i]);
+    if (arguments[i] == NULL) {
+      return NULL;
+    }
+    from = arguments[i] + argumentLengths[i];
+    offset += argumentLengths[i];
+  }
+  char* expression = strippedLine + offset;
+  if (expression[0] == '\0' || strchr(expression, '=')) {
+    return NULL;
+  }
+  return expression;
+}
+
+/**
+ * range_handler()
+ * ----------------
+ * Processes a @range command of the form "@range <var> <expression>", which
+ *evaluates the expression for every value of the loop variable var. The
+ *expression is compiled once for the whole range, or once for each thread when
+ *--jobs allows a long range to be shared between threads.
+ *
+ * line: The command, with no leading whitespace. It need not be
+ *null-terminated.
+ * length: The number of characters in line.
+ * strippedLine: Null-terminated copy of line with whitespace removed.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: If the command is malformed, var is not a loop variable, or the
+ *expression is invalid, prints an error message to stderr.
+ *
+ **/
+void range_handler(const char line[], size_t length, char strippedLine[],
+                   Def** defs, const int* defSize, Loop** loops,
+                   int sigFigures) {
+  const char* name;
+  size_t nameLength;
+  char* strippedExpression = command_arguments(
+      line, length, strippedLine, strlen(range), 1, &name, &nameLength);
+  if (strippedExpression == NULL || nameLength > VARIABLE_NAME_MAX) {
+    report_error();
+    return;
+  }
+  char loopName[VARIABLE_NAME_SIZE];
+  memcpy(loopName, name, nameLength);
+  loopName[nameLength] = '\0';
+
+  const Symbol* symbol = symbol_lookup(loopName);
+  if (valid_variable_name(loopName) == 0 || symbol == NULL ||
+      symbol->isLoop == 0) {
+    report_error();
+    return;
+  }
+  const Loop* loopVariable = &(*loops)[symbol->index];
+
+  double loopValue = loopVariable->start;
+  Program* program;
+  te_expr* expr = compile_range(strippedExpression, &loopVariable, 1,
+                                &loopValue, defs, defSize, &program);
+  if (expr == NULL) {
+    report_error();
+    return;
+  }
+
+  // Long ranges are shared between threads, each with its own copy
+  const long steps = range_steps(loopVariable);
+  if (evalJobs > 1 && steps >= RANGE_PARALLEL_MIN_STEPS) {
+    program_free(program);
+    te_free(expr);
+    sweep_evaluate(strippedExpression, &loopVariable, 1, steps, REDUCE_NONE,
+                   defs, defSize, sigFigures);
+    return;
+  }
+  program_warm(program, steps);
+  range_evaluate(expr, program, loopVariable, &loopValue, sigFigures);
+  program_free(program);
+  te_free(expr);
+}
+
+/**
+ * map_descriptor()
+ * ----------------
+ * Maps an open regular file into memory to be read from start to end. The
+ *mapping stays valid once the descriptor is closed.
+ *
+ * fd: The file descriptor.
+ * size: Pointer to where the size of the file is stored.
+ *
+ * Returns: The mapping, which the caller must munmap(), or NULL if the file is
+ *not a regular file, is empty or cannot be mapped.
+ *
+ **/
+char* map_descriptor(int fd, size_t* size) {
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode) ||
+      fileStat.st_size == 0) {
+    return NULL;
+  }
+  *size = fileStat.st_size;
+  char* mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(mapping, *size, MADV_SEQUENTIAL);
+  return mapping;
+}
+
+/**
+ * map_file()
+ * ----------------
+ * Maps a regular file into memory to be read from start to end.
+ *
+ * path: The path of the file.
+ * size: Pointer to where the size of the file is stored.
+ *
+ * Returns: The mapping, which the caller must munmap(), or NULL if the file
+ *cannot be read, is not a regular file or is empty.
+ *
+ **/
+char* map_file(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  char* mapping = map_descriptor(fileno(file), size);
+  fclose(file);
+  return mapping;
+}
+
+/**
+ * state_save()
+ * ----------------
+ * Writes every Def and Loop to a state file. The file is written under a
+ *temporary name and then renamed, so a reader never sees it half written.
+ *
+ * path: The path of the state file.
+ * defs: The array of defined variables.
+ * defSize: The number of defined variables.
+ * loops: The array of loop variables.
+ * loopSize: The number of loop variables.
+ *
+ * Returns: 1 if the file was written, or 0 if it could not be.
+ *
+ **/
+int state_save(const char* path, const Def* defs, int defSize,
+               const Loop* loops, int loopSize) {
+  StateHeader header;
+  memcpy(header.magic, stateMagic, STATE_MAGIC_SIZE);
+  header.version = STATE_VERSION;
+  header.byteOrder = STATE_BYTE_ORDER;
+  header.defCount = defSize;
+  header.loopCount = loopSize;
+  header.namesSize = 0;
+  for (int i = 0; i < defSize; ++i) {
+    header.namesSize += strlen(defs[i].name) + 1;
+  }
+  for (int i = 0; i < loopSize; ++i) {
+    header.namesSize += strlen(loops[i].name) + 1;
+  }
+
+  // Lay the whole file out in memory, names last
+  const size_t size = sizeof(StateHeader) + defSize * sizeof(StateDef) +
+                      loopSize * sizeof(StateLoop) + header.namesSize;
+  char* data = malloc(size);
+  memcpy(data, &header, sizeof(StateHeader));
+  StateDef* stateDefs = (StateDef*)(data + sizeof(StateHeader));
+  StateLoop* stateLoops = (StateLoop*)(stateDefs + defSize);
+  char* names = (char*)(stateLoops + loopSize);
+  uint32_t nameOffset = 0;
+  for (int i = 0; i < defSize; ++i) {
+    const size_t length = strlen(defs[i].name);
+    stateDefs[i].value = defs[i].value;
+    stateDefs[i].name = nameOffset;
+    stateDefs[i].length = length;
+    memcpy(names + nameOffset, defs[i].name, length + 1);
+    nameOffset += length + 1;
+  }
+  for (int i = 0; i < loopSize; ++i) {
+    const size_t length = strlen(loops[i].name);
+    stateLoops[i].start = loops[i].start;
+    stateLoops[i].increment = loops[i].increment;
+    stateLoops[i].end = loops[i].end;
+    stateLoops[i].name = nameOffset;
+    stateLoops[i].length = length;
+    memcpy(names + nameOffset, loops[i].name, length + 1);
+    nameOffset += length + 1;
+  }
+
+  char* temporary = malloc(strlen(path) + strlen(stateTemporarySuffix) + 1);
+  strcpy(temporary, path);
+  strcat(temporary, stateTemporarySuffix);
+  FILE* file = fopen(temporary, "wb");
+  int saved = file != NULL && fwrite(data, 1, size, file) == size;
+  if (file != NULL) {
+    saved = (fclose(file) == 0) && saved;
+  }
+  saved = saved && rename(temporary, path) == 0;
+  if (!saved) {
+    unlink(temporary);
+  }
+  free(temporary);
+  free(data);
+  return saved;
+}
+
+/**
+ * state_name()
+ * ----------------
+ * Finds a variable name in the names of a state file, checking that it lies
+ *within them and is a valid name of the length recorded for it.
+ *
+ * names: The names of the state file.
+ * namesSize: The number of bytes of names.
+ * offset: Where the name starts within names.
+ * length: The recorded length of the name.
+ *
+ * Returns: The null-terminated name, or NULL if it is not valid.
+ *
+ **/
+const char* state_name(const char* names, uint32_t namesSize, uint32_t offset,
+                       uint32_t length) {
+  if (offset >= namesSize || length >= namesSize - offset ||
+      length > VARIABLE_NAME_MAX) {
+    return NULL;
+  }
+  const char* name = names + offset;
+  if (name[length] != '\0' || strlen(name) != length ||
+      valid_variable_name(name) == 0) {
+    return NULL;
+  }
+  return name;
+}
+
+/**
+ * state_check_names()
+ * ----------------
+ * Checks that no name appears twice in a state file, and that no name already
+ *belongs to a variable of the other kind.
+ *
+ * names: Every name in the state file, with the Def names first.
+ * defCount: The number of Def names.
+ * count: The number of names.
+ *
+ * Returns: 1 if the names can all be loaded, or 0 if they cannot.
+ *
+ **/
+int state_check_names(const char** names, int defCount, int count) {
+  int size = SYMBOL_TABLE_MIN_SIZE;
+  while (size < count * 2) {
+    size *= 2;
+  }
+  const char** seen = arena_alloc(&lineArena, size * sizeof(const char*));
+  memset(seen, 0, size * sizeof(const char*));
+
+  for (int i = 0; i < count; ++i) {
+    const Symbol* symbol = symbol_lookup(names[i]);
+    if (symbol != NULL && symbol->isLoop != (i >= defCount)) {
+      return 0;
+    }
+    unsigned int slot = hash_string(names[i]) & (size - 1);
+    while (seen[slot] != NULL) {
+      if (strcmp(seen[slot], names[i]) == 0) {
+        return 0;
+      }
+      slot = (slot + 1) & (size - 1);
+    }
+    seen[slot] = names[i];
+  }
+  return 1;
+}
+
+/**
+ * state_apply()
+ * ----------------
+ * Loads the variables of a state file that has been mapped into memory. The
+ *whole file is checked before anything is loaded, so a file that is not valid
+ *changes nothing. A Def or Loop that already exists takes the value in the
+ *file, and any other is added. In reactive mode, a loaded Def holds a plain
+ *value. Once everything is loaded, the Defs that depend on those whose values
+ *changed are recomputed in a single propagation, so each is printed at most
+ *once and only with its value in the loaded state.
+ *
+ * data: The contents of the file.
+ * size: The size of the file in bytes.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: 1 if the file was loaded, or 0 if it is not a valid state file.
+ *
+ **/
+int state_apply(const char* data, size_t size, Def** defs, int* defSize,
+                Loop** loops, int* loopSize, int sigFigures) {
+  StateHeader header;
+  if (size < sizeof(StateHeader)) {
+    return 0;
+  }
+  memcpy(&header, data, sizeof(StateHeader));
+  if (memcmp(header.magic, stateMagic, STATE_MAGIC_SIZE) != 0 ||
+      header.version != STATE_VERSION ||
+      header.byteOrder != STATE_BYTE_ORDER ||
+      header.defCount > (size - sizeof(StateHeader)) / sizeof(StateDef) ||
+      header.loopCount > (size - sizeof(StateHeader)) / sizeof(StateLoop) ||
+      size != sizeof(StateHeader) + header.defCount * sizeof(StateDef) +
+                  header.loopCount * sizeof(StateLoop) + header.namesSize) {
+    return 0;
+  }
+  const StateDef* stateDefs = (const StateDef*)(data + sizeof(StateHeader));
+  const StateLoop* stateLoops = (const StateLoop*)(stateDefs + header.defCount);
+  const char* names = (const char*)(stateLoops + header.loopCount);
+
+  // Check every variable before loading any of them
+  const int count = header.defCount + header.loopCount;
+  const char** variableNames =
+      arena_alloc(&lineArena, (count ? count : 1) * sizeof(const char*));
+  for (int i = 0; i < count; ++i) {
+    const int isLoop = i >= (int)header.defCount;
+    const uint32_t offset = isLoop ? stateLoops[i - header.defCount].name
+                                   : stateDefs[i].name;
+    const uint32_t length = isLoop ? stateLoops[i - header.defCount].length
+                                   : stateDefs[i].length;
+    variableNames[i] = state_name(names, header.namesSize, offset, length);
+    if (variableNames[i] == NULL) {
+      return 0;
+    }
+    if (isLoop) {
+      const StateLoop* loop = &stateLoops[i - header.defCount];
+      if (valid_loop_values(loop->start, loop->increment, loop->end) == 0) {
+        return 0;
+      }
+    } else if (isnan(stateDefs[i].value)) {
+      return 0;
+    }
+  }
+  if (state_check_names(variableNames, header.defCount, count) == 0) {
+    return 0;
+  }
+
+  // Every value is loaded before any dependent is recomputed, so that
+  // formulas only ever see the state as it was saved
+  int* changed = arena_alloc(&lineArena, (count ? count : 1) * sizeof(int));
+  int changedCount = 0;
+  for (uint32_t i = 0; i < header.defCount; ++i) {
+    const double value = stateDefs[i].value;
+    const Symbol* symbol = symbol_lookup(variableNames[i]);
+    if (symbol == NULL) {
+      add_def(defs, defSize, variableNames[i], value);
+      continue;
+    }
+    const int index = symbol->index;
+    if (index < formulasCapacity) {
+      reactive_forget(index);
+    }
+    if (memcmp(&(*defs)[index].value, &value, sizeof(double)) != 0) {
+      (*defs)[index].value = value;
+      memoChanges++;
+      changed[changedCount++] = index;
+    }
+  }
+  for (uint32_t i = 0; i < header.loopCount; ++i) {
+    const StateLoop* loop = &stateLoops[i];
+    const Symbol* symbol = symbol_lookup(variableNames[header.defCount + i]);
+    if (symbol == NULL) {
+      add_loop(loops, loopSize, variableNames[header.defCount + i],
+               loop->start, loop->increment, loop->end);
+    } else {
+      (*loops)[symbol->index].start = loop->start;
+      (*loops)[symbol->index].increment = loop->increment;
+      (*loops)[symbol->index].end = loop->end;
+    }
+  }
+  if (reactiveEnabled) {
+    reactive_propagate(defs, defSize, changed, changedCount, sigFigures);
+  }
+  return 1;
+}
+
+/**
+ * state_load()
+ * ----------------
+ * Loads the variables of a state file written by state_save(), mapping it
+ *into memory so that nothing in it needs to be parsed or evaluated.
+ *
+ * path: The path of the state file.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: 1 if the file was loaded, or 0 if it could not be read or is not a
+ *valid state file.
+ *
+ **/
+int state_load(const char* path, Def** defs, int* defSize, Loop** loops,
+               int* loopSize, int sigFigures) {
+  size_t size;
+  char* mapping = map_file(path, &size);
+  if (mapping == NULL) {
+    return 0;
+  }
+  const int loaded =
+      state_apply(mapping, size, defs, defSize, loops, loopSize, sigFigures);
+  munmap(mapping, size);
+  return loaded;
+}
+
+/**
+ * state_handler()
+ * ----------------
+ * Processes a @save or @load command of the form "@save <file>", which writes
+ *every variable to file, or "@load <file>", which loads the variables in file.
+ *
+ * line: The line holding the command, which need not be null-terminated.
+ * length: The number of characters in line.
+ * kind: LINE_SAVE or LINE_LOAD.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: If the command is malformed, or the file cannot be written, read or
+ *is not a valid state file, prints an error message to stderr.
+ *
+ **/
+void state_handler(const char line[], size_t length, int kind, Def** defs,
+                   int* defSize, Loop** loops, int* loopSize,
+                   int sigFigures) {
+  // There must be a single space between the command and the file name
+  const size_t commandLength = strlen((kind == LINE_SAVE) ? save : load);
+  if (length < commandLength + 2 || line[commandLength] != ' ') {
+    report_error();
+    return;
+  }
+  const char* path = arena_strndup(&lineArena, line + commandLength + 1,
+                                   length - commandLength - 1);
+
+  const int done =
+      (kind == LINE_SAVE)
+          ? state_save(path, *defs, *defSize, *loops, *loopSize)
+          : state_load(path, defs, defSize, loops, loopSize, sigFigures);
+  if (!done) {
+    report_error();
+  }
+}
+
+/**
+ * table_bind()
+ * ----------------
+ * Binds the columns of a table to the Defs named in a comma-separated list,
+ *allocating a block with a column for each of them from lineArena. Spaces and
+ *tabs around each name are ignored.
+ *
+ * block: The block to set up.
+ * names: The list of names, which need not be null-terminated.
+ * length: The number of characters in names.
+ * defs: Pointer to the array of defined variables.
+ *
+ * Returns: 1 if every name is a Def named only once, 0 otherwise.
+ *
+ **/
+int table_bind(TableBlock* block, const char* names, size_t length,
+               Def** defs) {
+  const char* end = names + length;
+  int count = 1;
+  for (const char* c = names; c < end; ++c) {
+    count += (*c == ',');
+  }
+  block->columnCount = count;
+  block->rowCount = 0;
+  block->bindings = arena_alloc(&lineArena, count * sizeof(double*));
+  block->columns =
+      arena_alloc(&lineArena, count * TABLE_BLOCK_SIZE * sizeof(double));
+
+  const char* name = names;
+  for (int i = 0; i < count; ++i) {
+    const char* comma = memchr(name, ',', end - name);
+    const char* nameEnd = comma ? comma : end;
+    while (name < nameEnd && (*name == ' ' || *name == '\t')) {
+      name++;
+    }
+    while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) {
+      nameEnd--;
+    }
+    const Symbol* symbol = (nameEnd - name > VARIABLE_NAME_MAX)
+                               ? NULL
+                               : symbol_lookup_name(name, nameEnd - name);
+    if (symbol == NULL || symbol->isLoop) {
+      return 0;
+    }
+    block->bindings[i] = &(*defs)[symbol->index].value;
+    for (int j = 0; j < i; ++j) {
+      if (block->bindings[j] == block->bindings[i]) {
+        return 0;
+      }
+    }
+    name = (comma ? comma : end) + 1;
+  }
+  return 1;
+}
+
+/**
+ * table_run()
+ * ----------------
+ * Evaluates an expression for every row of a block, then prints each result
+ *in the format Result = <result>.
+ *
+ * block: The block of the table, whose rows are then emptied.
+ * expr: The compiled expression.
+ * program: expr lowered for the selected backend, or NULL to evaluate expr
+ *with tinyexpr, which reads the Defs bound to the columns of the block.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: Prints an error message to stderr for every row that could not be
+ *read or whose result is invalid.
+ *
+ **/
+void table_run(TableBlock* block, const te_expr* expr, const Program* program,
+               int sigFigures) {
+  double results[TABLE_BLOCK_SIZE];
+
+  stats_begin(STAGE_EVAL);
+  block_evaluate(block, expr, program, results);
+  stats_end(block->rowCount);
+
+  stats_begin(STAGE_OUTPUT);
+  for (int i = 0; i < block->rowCount; ++i) {
+    if (!block->valid[i] || isnan(results[i])) {
+      report_error();
+      continue;
+    }
+    output_result(results[i], NULL, 0, sigFigures);
+  }
+  stats_end(block->rowCount);
+  block->rowCount = 0;
+}
+
+/**
+ * table_field()
+ * ----------------
+ * Reads the number in a field of a CSV row. Spaces and tabs around it are
+ *ignored.
+ *
+ * field: The field, which need not be null-terminated.
+ * length: The number of characters in field.
+ * value: Pointer to where the number is stored.
+ *
+ * Returns: 1 if the field holds a valid double, 0 otherwise.
+ *
+ **/
+int table_field(const char* field, size_t length, double* value) {
+  while (length > 0 && (*field == ' ' || *field == '\t')) {
+    field++;
+    length--;
+  }
+  while (length > 0 &&
+         (field[length - 1] == ' ' || field[length - 1] == '\t')) {
+    length--;
+  }
+  if (length == 0 || length >= TABLE_FIELD_SIZE) {
+    return 0;
+  }
+  char text[TABLE_FIELD_SIZE];
+  memcpy(text, field, length);
+  text[length] = '\0';
+  char* endptr;
+  *value = strtod(text, &endptr);
+  return *endptr == '\0';
+}
+
+/**
+ * table_csv()
+ * ----------------
+ * Reads the rows of a CSV table into blocks, evaluating and printing each
+ *block once it is full. Blank lines are skipped, and a row is only valid if it
+ *holds a number for every column.
+ *
+ * block: The block to read rows into, with its columns bound.
+ * text: The rows of the table, following its header.
+ * length: The number of characters in text.
+ * expr: The compiled expression.
+ * program: expr lowered for the selected backend, or NULL.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ **/
+void table_csv(TableBlock* block, const char* text, size_t length,
+               const te_expr* expr, const Program* program, int sigFigures) {
+  const char* end = text + length;
+  while (text < end) {
+    const char* newline = memchr(text, '\n', end - text);
+    const char* lineEnd = newline ? newline : end;
+    const char* next = lineEnd + 1;
+    if (lineEnd > text && lineEnd[-1] == '\r') {
+      lineEnd--;
+    }
+    if (lineEnd == text) {
+      text = next;
+      continue;
+    }
+
+    const int row = block->rowCount++;
+    block->valid[row] = 1;
+    const char* field = text;
+    for (int i = 0; i < block->columnCount; ++i) {
+      const char* comma = memchr(field, ',', lineEnd - field);
+      const int last = i == block->columnCount - 1;
+      const char* fieldEnd = comma ? comma : lineEnd;
+      double* value = &block->columns[i * TABLE_BLOCK_SIZE + row];
+      if ((comma == NULL) != last ||
+          table_field(field, fieldEnd - field, value) == 0) {
+        block->valid[row] = 0;
+        *value = 0;
+      }
+      field = (comma && !last) ? comma + 1 : lineEnd;
+    }
+
+    if (block->rowCount == TABLE_BLOCK_SIZE) {
+      table_run(block, expr, program, sigFigures);
+    }
+    text = next;
+  }
+  if (block->rowCount > 0) {
+    table_run(block, expr, program, sigFigures);
+  }
+}
+
+/**
+ * table_binary()
+ * ----------------
+ * Reads the rows of a binary table into blocks, evaluating and printing each
+ *block once it is full. The table holds a native double for every column of
+ *each row in turn.
+ *
+ * block: The block to read rows into, with its columns bound.
+ * data: The table.
+ * rowCount: The number of rows in the table.
+ * expr: The compiled expression.
+ * program: expr lowered for the selected backend, or NULL.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ **/
+void table_binary(TableBlock* block, const char* data, size_t rowCount,
+                  const te_expr* expr, const Program* program,
+                  int sigFigures) {
+  const size_t rowSize = block->columnCount * sizeof(double);
+  for (size_t first = 0; first < rowCount; first += TABLE_BLOCK_SIZE) {
+    const int rows = (rowCount - first < TABLE_BLOCK_SIZE) ? rowCount - first
+                                                           : TABLE_BLOCK_SIZE;
+
+    // Gather the rows of the block into its columns
+    const char* row = data + first * rowSize;
+    for (int i = 0; i < rows; ++i, row += rowSize) {
+      for (int j = 0; j < block->columnCount; ++j) {
+        memcpy(&block->columns[j * TABLE_BLOCK_SIZE + i],
+               row + j * sizeof(double), sizeof(double));
+      }
+      block->valid[i] = 1;
+    }
+    block->rowCount = rows;
+    table_run(block, expr, program, sigFigures);
+  }
+}
+
+/**
+ * table_handler()
+ * ----------------
+ * Processes a @csv command of the form "@csv <file> <expression>", or a
+ *@binary command of the form "@binary <file> <names> <expression>", which
+ *evaluates the expression once for every row of a table, printing each result
+ *in the format Result = <result>. The first line of a CSV file names the Def
+ *bound to each of its columns; the columns of a binary file are bound to the
+ *comma-separated Defs in names. The expression is compiled once for the whole
+ *table, and the table is read and evaluated a block of rows at a time, so its
+ *results are written as it is read. The Defs bound to columns keep the values
+ *they had before.
+ *
+ * line: The command, with no leading whitespace. It need not be
+ *null-terminated.
+ * length: The number of characters in line.
+ * strippedLine: Null-terminated copy of line with whitespace removed.
+ * kind: LINE_CSV or LINE_BINARY.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: If the command is malformed, the file cannot be read, a column is
+ *not bound to a Def, the size of a binary file is not a whole number of rows,
+ *or the expression is invalid, prints an error message to stderr.
+ *
+ **/
+void table_handler(const char line[], size_t length, char strippedLine[],
+                   int kind, Def** defs, const int* defSize, int sigFigures) {
+  // A binary file is followed by the names of its columns
+  const char* arguments[2] = {NULL, NULL};
+  size_t argumentLengths[2] = {0, 0};
+  char* expression = command_arguments(
+      line, length, strippedLine, strlen((kind == LINE_CSV) ? csv : binary),
+      (kind == LINE_CSV) ? 1 : 2, arguments, argumentLengths);
+  if (expression == NULL) {
+    report_error();
+    return;
+  }
+  const char* path = arguments[0];
+  const size_t pathLength = argumentLengths[0];
+  const char* names = arguments[1];
+  const size_t namesLength = argumentLengths[1];
+
+  size_t size;
+  char* data = map_file(arena_strndup(&lineArena, path, pathLength), &size);
+  if (data == NULL) {
+    report_error();
+    return;
+  }
+
+  // A CSV file names its columns in its first line
+  TableBlock block;
+  const char* rows = data;
+  int bound;
+  if (kind == LINE_CSV) {
+    const char* newline = memchr(data, '\n', size);
+    const char* headerEnd = newline ? newline : data + size;
+    rows = newline ? newline + 1 : data + size;
+    if (headerEnd > data && headerEnd[-1] == '\r') {
+      headerEnd--;
+    }
+    bound = table_bind(&block, data, headerEnd - data, defs);
+  } else {
+    bound = table_bind(&block, names, namesLength, defs);
+  }
+
+  double unused;
+  Program* program = NULL;
+  te_expr* expr = NULL;
+  if (bound && (kind == LINE_CSV ||
+                size % (block.columnCount * sizeof(double)) == 0)) {
+    expr = compile_range(expression, NULL, 0, &unused, defs, defSize,
+                         &program);
+  }
+  if (expr == NULL) {
+    munmap(data, size);
+    report_error();
+    return;
+  }
+
+  double* saved = arena_alloc(&lineArena, block.columnCount * sizeof(double));
+  for (int i = 0; i < block.columnCount; ++i) {
+    saved[i] = *block.bindings[i];
+  }
+  if (kind == LINE_CSV) {
+    table_csv(&block, rows, data + size - rows, expr, program, sigFigures);
+  } else {
+    table_binary(&block, data, size / (block.columnCount * sizeof(double)),
+                 expr, program, sigFigures);
+  }
+  for (int i = 0; i < block.columnCount; ++i) {
+    *block.bindings[i] = saved[i];
+  }
+
+  program_free(program);
+  te_free(expr);
+  munmap(data, size);
+}
+
+/**
+ * sweep_queue()
+ * ----------------
+ * Packs the blocks a sweep worker has left to evaluate into one word, so that
+ *they can be taken or stolen with a single compare and swap.
+ *
+ * first: The first block left.
+ * end: One past the last block left.
+ *
+ * Returns: The packed queue.
+ *
+ **/
+uint64_t sweep_queue(uint32_t first, uint32_t end) {
+  return ((uint64_t)first << SWEEP_QUEUE_SHIFT) | end;
+}
+
+/**
+ * sweep_take()
+ * ----------------
+ * Takes the first block left in a sweep worker's own queue.
+ *
+ * worker: The worker.
+ *
+ * Returns: The block, or -1 if the queue is empty.
+ *
+ **/
+int sweep_take(SweepWorker* worker) {
+  uint64_t queue = __atomic_load_n(&worker->queue, __ATOMIC_ACQUIRE);
+  for (;;) {
+    const uint32_t first = queue >> SWEEP_QUEUE_SHIFT;
+    const uint32_t end = (uint32_t)queue;
+    if (first >= end) {
+      return -1;
+    }
+    if (__atomic_compare_exchange_n(&worker->queue, &queue,
+                                    sweep_queue(first + 1, end), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return first;
+    }
+  }
+}
+
+/**
+ * sweep_steal()
+ * ----------------
+ * Steals the last half of the blocks left in another sweep worker's queue
+ *once a worker's own queue is empty, so that workers given slower blocks are
+ *helped by those that finish early. The stolen blocks after the first become
+ *the thief's queue.
+ *
+ * sweep: The sweep being evaluated.
+ * thief: The worker whose queue is empty.
+ *
+ * Returns: The first stolen block, or -1 if no worker has any left.
+ *
+ **/
+int sweep_steal(Sweep* sweep, SweepWorker* thief) {
+  const int thiefIndex = thief - sweep->workers;
+  for (int i = 1; i < sweep->workerCount; ++i) {
+    SweepWorker* victim =
+        &sweep->workers[(thiefIndex + i) % sweep->workerCount];
+    uint64_t queue = __atomic_load_n(&victim->queue, __ATOMIC_ACQUIRE);
+    for (;;) {
+      const uint32_t first = queue >> SWEEP_QUEUE_SHIFT;
+      const uint32_t end = (uint32_t)queue;
+      if (first >= end) {
+        break;
+      }
+      const uint32_t middle = end - (end - first + 1) / 2;
+      if (__atomic_compare_exchange_n(&victim->queue, &queue,
+                                      sweep_queue(first, middle), 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&thief->queue, sweep_queue(middle + 1, end),
+                         __ATOMIC_RELEASE);
+        return middle;
+      }
+    }
+  }
+  return -1;
+}
+
+/**
+ * sweep_format()
+ * ----------------
+ * Formats the lines printed for a tile of a sweep into the chunk of its
+ *block, in the format Result = <result> when <var> = <value>, with a value for
+ *each loop variable of the sweep separated by ", ".
+ *
+ * sweep: The sweep being evaluated.
+ * chunk: The chunk of the block the tile belongs to.
+ * tile: The tile, with a column of values for each loop variable.
+ * results: The result for each point of the tile.
+ *
+ * Returns: void
+ *
+ **/
+void sweep_format(const Sweep* sweep, SweepChunk* chunk,
+                  const TableBlock* tile, const double* results) {
+  const DoubleFormatter format = doubleFormatters[sweep->sigFigures];
+  char* text = chunk->text + chunk->length;
+  for (int i = 0; i < tile->rowCount; ++i) {
+    const int invalid = isnan(results[i]);
+    if (invalid) {
+      chunk->errors[chunk->errorCount++] = text - chunk->text;
+    }
+    if (outputFormat != OUTPUT_TEXT) {
+      // As records, an error is followed by its point like a result
+      if (!invalid) {
+        text += format_record(text, RECORD_RESULT, NULL, results[i]);
+      }
+      for (int j = 0; j < sweep->dimensions; ++j) {
+        text += format_record(text, RECORD_POINT, sweep->loops[j]->name,
+                              tile->columns[j * TABLE_BLOCK_SIZE + i]);
+      }
+      continue;
+    }
+    if (invalid) {
+      continue;
+    }
+    memcpy(text, "Result = ", 9);
+    text += 9;
+    text += format(text, results[i]);
+    memcpy(text, " when ", 6);
+    text += 6;
+    for (int j = 0; j < sweep->dimensions; ++j) {
+      if (j > 0) {
+        memcpy(text, ", ", 2);
+        text += 2;
+      }
+      const size_t nameLength = strlen(sweep->loops[j]->name);
+      memcpy(text, sweep->loops[j]->name, nameLength);
+      text += nameLength;
+      memcpy(text, " = ", 3);
+      text += 3;
+      text += format(text, tile->columns[j * TABLE_BLOCK_SIZE + i]);
+    }
+    *text++ = '\n';
+  }
+  chunk->length = text - chunk->text;
+}
+
+/**
+ * sum_add()
+ * ----------------
+ * Adds a term to a compensated sum. Whichever of the sum and the term is
+ *larger in magnitude keeps all its bits in their total, so the bits lost from
+ *the other can be worked out and kept in the compensation.
+ *
+ * total: The compensated sum.
+ * term: The term to add.
+ *
+ * Returns: void
+ *
+ **/
+void sum_add(CompensatedSum* total, double term) {
+  const double sum = total->sum + term;
+  if (fabs(total->sum) >= fabs(term)) {
+    total->compensation += (total->sum - sum) + term;
+  } else {
+    total->compensation += (term - sum) + total->sum;
+  }
+  total->sum = sum;
+}
+
+/**
+ * sum_merge()
+ * ----------------
+ * Adds one compensated sum to another.
+ *
+ * total: The compensated sum to add to.
+ * partial: The compensated sum to add.
+ *
+ * Returns: void
+ *
+ **/
+void sum_merge(CompensatedSum* total, const CompensatedSum* partial) {
+  sum_add(total, partial->sum);
+  total->compensation += partial->compensation;
+}
+
+/**
+ * sum_value()
+ * ----------------
+ * Finds the value of a compensated sum. Once the terms overflow, the
+ *compensation holds no meaningful bits, so the plain sum is used.
+ *
+ * total: The compensated sum.
+ *
+ * Returns: The value of the sum.
+ *
+ **/
+double sum_value(const CompensatedSum* total) {
+  return isfinite(total->sum) ? total->sum + total->compensation : total->sum;
+}
+
+/**
+ * sweep_reduce()
+ * ----------------
+ * Folds the results of a tile of a sweep into the partial reduction of its
+ *block. Where SSE2 is available, pairs of results are summed with compensation
+ *in two lanes at once, along with the minimum, maximum and any invalid
+ *result, and the lanes are folded into the block's partial reduction at the
+ *end of the tile.
+ *
+ * chunk: The chunk of the block the tile belongs to.
+ * results: The result for each point of the tile.
+ * count: The number of points in the tile.
+ *
+ * Returns: void
+ *
+ **/
+void sweep_reduce(SweepChunk* chunk, const double* results, int count) {
+  int i = 0;
+#ifdef __SSE2__
+  if (count >= SSE2_DOUBLE_LANES) {
+    const __m128d signBit = _mm_set1_pd(-0.0);
+    __m128d sum = _mm_setzero_pd();
+    __m128d compensation = _mm_setzero_pd();
+    __m128d minimum = _mm_set1_pd(INFINITY);
+    __m128d maximum = _mm_set1_pd(-INFINITY);
+    __m128d invalid = _mm_setzero_pd();
+    for (; i + SSE2_DOUBLE_LANES <= count; i += SSE2_DOUBLE_LANES) {
+      const __m128d term = _mm_loadu_pd(results + i);
+      invalid = _mm_or_pd(invalid, _mm_cmpunord_pd(term, term));
+      minimum = _mm_min_pd(minimum, term);
+      maximum = _mm_max_pd(maximum, term);
+
+      // As in sum_add(), with the larger and smaller of the sum and the term
+      // chosen in each lane without branching
+      const __m128d total = _mm_add_pd(sum, term);
+      const __m128d sumLarger = _mm_cmpge_pd(_mm_andnot_pd(signBit, sum),
+                                             _mm_andnot_pd(signBit, term));
+      const __m128d larger = _mm_or_pd(_mm_and_pd(sumLarger, sum),
+                                       _mm_andnot_pd(sumLarger, term));
+      const __m128d smaller = _mm_or_pd(_mm_and_pd(sumLarger, term),
+                                        _mm_andnot_pd(sumLarger, sum));
+      compensation = _mm_add_pd(
+          compensation, _mm_add_pd(_mm_sub_pd(larger, total), smaller));
+      sum = total;
+    }
+
+    double lanes[SSE2_DOUBLE_LANES];
+    double laneCompensations[SSE2_DOUBLE_LANES];
+    double laneMinimums[SSE2_DOUBLE_LANES];
+    double laneMaximums[SSE2_DOUBLE_LANES];
+    _mm_storeu_pd(lanes, sum);
+    _mm_storeu_pd(laneCompensations, compensation);
+    _mm_storeu_pd(laneMinimums, minimum);
+    _mm_storeu_pd(laneMaximums, maximum);
+    chunk->invalid |= _mm_movemask_pd(invalid) != 0;
+    for (int j = 0; j < SSE2_DOUBLE_LANES; ++j) {
+      const CompensatedSum lane = {lanes[j], laneCompensations[j]};
+      sum_merge(&chunk->sum, &lane);
+      if (laneMinimums[j] < chunk->minimum) {
+        chunk->minimum = laneMinimums[j];
+      }
+      if (laneMaximums[j] > chunk->maximum) {
+        chunk->maximum = laneMaximums[j];
+      }
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    chunk->invalid |= isnan(results[i]) != 0;
+    sum_add(&chunk->sum, results[i]);
+    if (results[i] < chunk->minimum) {
+      chunk->minimum = results[i];
+    }
+    if (results[i] > chunk->maximum) {
+      chunk->maximum = results[i];
+    }
+  }
+}
+
+/**
+ * sweep_block()
+ * ----------------
+ * Evaluates one block of points of a sweep with a worker's own copy of the
+ *expression, a tile of TABLE_BLOCK_SIZE points at a time, and formats or
+ *reduces the results into the block's chunk. Points are numbered with the last
+ *loop variable changing fastest, as in nested loops.
+ *
+ * sweep: The sweep being evaluated.
+ * worker: The worker evaluating the block.
+ * block: The block within the current round.
+ *
+ * Returns: void
+ *
+ **/
+void sweep_block(Sweep* sweep, SweepWorker* worker, int block) {
+  double results[TABLE_BLOCK_SIZE];
+  const long first = sweep->roundFirst + (long)block * SWEEP_BLOCK_SIZE;
+  const int blockSize = (sweep->points - first < SWEEP_BLOCK_SIZE)
+                            ? sweep->points - first
+                            : SWEEP_BLOCK_SIZE;
+
+  // Find the step of each loop variable at the first point
+  long step[SWEEP_DIMENSIONS_MAX];
+  long rest = first;
+  for (int i = sweep->dimensions - 1; i >= 0; --i) {
+    step[i] = rest % sweep->steps[i];
+    rest /= sweep->steps[i];
+  }
+
+  SweepChunk* chunk = &sweep->chunks[block];
+  chunk->length = 0;
+  chunk->errorCount = 0;
+  chunk->invalid = 0;
+  chunk->sum.sum = 0;
+  chunk->sum.compensation = 0;
+  chunk->minimum = INFINITY;
+  chunk->maximum = -INFINITY;
+
+  TableBlock* tile = &worker->tile;
+  for (int done = 0; done < blockSize; done += tile->rowCount) {
+    tile->rowCount = (blockSize - done < TABLE_BLOCK_SIZE) ? blockSize - done
+                                                           : TABLE_BLOCK_SIZE;
+    for (int i = 0; i < tile->rowCount; ++i) {
+      for (int j = 0; j < sweep->dimensions; ++j) {
+        tile->columns[j * TABLE_BLOCK_SIZE + i] =
+            range_value(sweep->loops[j], step[j]);
+      }
+      // Move to the next point, carrying into slower loop variables
+      for (int j = sweep->dimensions - 1;
+           j >= 0 && ++step[j] == sweep->steps[j]; --j) {
+        step[j] = 0;
+      }
+    }
+
+    stats_begin(STAGE_EVAL);
+    block_evaluate(tile, worker->expr, worker->program, results);
+    stats_end(tile->rowCount);
+
+    stats_begin(STAGE_OUTPUT);
+    if (sweep->reduction == REDUCE_NONE) {
+      sweep_format(sweep, chunk, tile, results);
+    } else {
+      sweep_reduce(chunk, results, tile->rowCount);
+    }
+    stats_end(tile->rowCount);
+  }
+}
+
+/**
+ * sweep_worker_run()
+ * ----------------
+ * Thread entry point that evaluates blocks of the current round of a sweep,
+ *first from the worker's own queue and then stolen from others, until none are
+ *left.
+ *
+ * arg: Pointer to the SweepWorker.
+ *
+ * Returns: NULL
+ *
+ **/
+void* sweep_worker_run(void* arg) {
+  SweepWorker* worker = arg;
+  int block;
+  while ((block = sweep_take(worker)) >= 0 ||
+         (block = sweep_steal(worker->sweep, worker)) >= 0) {
+    sweep_block(worker->sweep, worker, block);
+  }
+  return NULL;
+}
+
+/**
+ * sweep_print_round()
+ * ----------------
+ * Prints the lines of a round of a sweep in order, reporting each invalid
+ *result where it fell.
+ *
+ * sweep: The sweep being evaluated.
+ * blocks: The number of blocks in the round.
+ *
+ * Returns: void
+ *
+ **/
+void sweep_print_round(const Sweep* sweep, int blocks) {
+  for (int i = 0; i < blocks; ++i) {
+    const SweepChunk* chunk = &sweep->chunks[i];
+    size_t printed = 0;
+    for (int j = 0; j < chunk->errorCount; ++j) {
+      output_text(chunk->text + printed, chunk->errors[j] - printed);
+      printed = chunk->errors[j];
+      report_error();
+    }
+    output_text(chunk->text + printed, chunk->length - printed);
+  }
+}
+
+/**
+ * sweep_evaluate()
+ * ----------------
+ * Evaluates an expression at every point of the grid formed by several loop
+ *variables, across as many threads as --jobs allows, and either prints every
+ *result or reduces them all to one. tinyexpr binds variables by address, so
+ *each worker compiles its own copy of the expression bound to its own loop
+ *values. The grid is evaluated a round of blocks at a time: each worker starts
+ *with an even share of the blocks and steals from the others once its own run
+ *out, then the round is printed, or its partial reductions combined, in block
+ *order, so the output does not depend on the number of threads. A reduction
+ *keeps only its running value, and sums are compensated both within blocks
+ *and as blocks are combined, so they stay accurate over millions of points.
+ *
+ * expression: Null-terminated string representing the expression, which must
+ *already be known to compile.
+ * loops: The loop variables, the last of which changes fastest.
+ * dimensions: The number of loop variables.
+ * points: The number of points in the grid.
+ * reduction: REDUCE_NONE to print every result, or the reduction to print.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: Prints an error message to stderr for every result that is invalid,
+ *or once if any result of a reduction is invalid.
+ *
+ **/
+void sweep_evaluate(const char* expression, const Loop* const* loops,
+                    int dimensions, long points, int reduction, Def** defs,
+                    const int* defSize, int sigFigures) {
+  Sweep sweep;
+  sweep.dimensions = dimensions;
+  for (int i = 0; i < dimensions; ++i) {
+    sweep.loops[i] = loops[i];
+    sweep.steps[i] = range_steps(loops[i]);
+  }
+  sweep.points = points;
+  sweep.reduction = reduction;
+  sweep.sigFigures = sigFigures;
+
+  const long totalBlocks = (points + SWEEP_BLOCK_SIZE - 1) / SWEEP_BLOCK_SIZE;
+  sweep.workerCount = (totalBlocks < evalJobs) ? totalBlocks : evalJobs;
+  sweep.workers = malloc(sweep.workerCount * sizeof(SweepWorker));
+  for (int i = 0; i < sweep.workerCount; ++i) {
+    SweepWorker* worker = &sweep.workers[i];
+    worker->sweep = &sweep;
+    for (int j = 0; j < dimensions; ++j) {
+      worker->loopValues[j] = loops[j]->start;
+      worker->bindings[j] = &worker->loopValues[j];
+    }
+    worker->tile.columnCount = dimensions;
+    worker->tile.bindings = worker->bindings;
+    worker->tile.columns = worker->columns;
+    worker->expr = compile_range(expression, loops, dimensions,
+                                 worker->loopValues, defs, defSize,
+                                 &worker->program);
+  }
+
+  const int roundBlocks = sweep.workerCount * SWEEP_ROUND_BLOCKS;
+  const size_t lineSize =
+      (outputFormat == OUTPUT_TEXT)
+          ? SWEEP_LINE_SIZE + dimensions * SWEEP_VARIABLE_SIZE
+          : (dimensions + 1) * RECORD_TEXT_SIZE;
+  sweep.chunks = malloc(roundBlocks * sizeof(SweepChunk));
+  for (int i = 0; i < roundBlocks; ++i) {
+    const int printing = reduction == REDUCE_NONE;
+    sweep.chunks[i].text =
+        printing ? malloc(SWEEP_BLOCK_SIZE * lineSize) : NULL;
+    sweep.chunks[i].errors =
+        printing ? malloc(SWEEP_BLOCK_SIZE * sizeof(int)) : NULL;
+  }
+
+  CompensatedSum sum = {0, 0};
+  double minimum = INFINITY;
+  double maximum = -INFINITY;
+  int invalid = 0;
+  const long roundPoints = (long)roundBlocks * SWEEP_BLOCK_SIZE;
+  for (sweep.roundFirst = 0; sweep.roundFirst < points;
+       sweep.roundFirst += roundPoints) {
+    const long left = points - sweep.roundFirst;
+    const int blocks = (left < roundPoints)
+                           ? (left + SWEEP_BLOCK_SIZE - 1) / SWEEP_BLOCK_SIZE
+                           : roundBlocks;
+
+    // Give each worker an even, contiguous share of the round to start with
+    for (int i = 0; i < sweep.workerCount; ++i) {
+      sweep.workers[i].queue =
+          sweep_queue(blocks * i / sweep.workerCount,
+                      blocks * (i + 1) / sweep.workerCount);
+    }
+    for (int i = 1; i < sweep.workerCount; ++i) {
+      pthread_create(&sweep.workers[i].thread, NULL, sweep_worker_run,
+                     &sweep.workers[i]);
+    }
+    sweep_worker_run(&sweep.workers[0]);
+    for (int i = 1; i < sweep.workerCount; ++i) {
+      pthread_join(sweep.workers[i].thread, NULL);
+    }
+
+    if (reduction == REDUCE_NONE) {
+      sweep_print_round(&sweep, blocks);
+      continue;
+    }
+    for (int i = 0; i < blocks; ++i) {
+      const SweepChunk* chunk = &sweep.chunks[i];
+      invalid |= chunk->invalid;
+      sum_merge(&sum, &chunk->sum);
+      minimum = (chunk->minimum < minimum) ? chunk->minimum : minimum;
+      maximum = (chunk->maximum > maximum) ? chunk->maximum : maximum;
+    }
+  }
+
+  if (reduction != REDUCE_NONE) {
+    const double total = sum_value(&sum);
+    const double reductions[REDUCE_COUNT] = {NAN, total, minimum, maximum,
+                                             total / points};
+    if (invalid || isnan(reductions[reduction])) {
+      report_error();
+    } else {
+      print_expression(reductions[reduction], sigFigures);
+    }
+  }
+
+  for (int i = 0; i < roundBlocks; ++i) {
+    free(sweep.chunks[i].text);
+    free(sweep.chunks[i].errors);
+  }
+  free(sweep.chunks);
+  for (int i = sweep.workerCount - 1; i >= 0; --i) {
+    program_free(sweep.workers[i].program);
+    te_free(sweep.workers[i].expr);
+  }
+  free(sweep.workers);
+}
+
+/**
+ * sweep_loops()
+ * ----------------
+ * Finds the loop variables named in the comma-separated list of a sweep.
+ *
+ * names: The list of names, which need not be null-terminated.
+ * length: The number of characters in names.
+ * loops: Pointer to the array of loop variables.
+ * sweepLoops: Where to store the loop variable of each name, which has room
+ *for SWEEP_DIMENSIONS_MAX.
+ * points: Pointer to where the number of points in their grid is stored.
+ *
+ * Returns: The number of loop variables, or 0 if a name is not a loop
+ *variable, is given twice, there are more than SWEEP_DIMENSIONS_MAX, or their
+ *grid has too many points to count.
+ *
+ **/
+int sweep_loops(const char* names, size_t length, Loop** loops,
+                const Loop** sweepLoops, long* points) {
+  const char* end = names + length;
+  int dimensions = 0;
+  *points = 1;
+  for (const char* name = names;; name++) {
+    const char* comma = memchr(name, ',', end - name);
+    const char* nameEnd = comma ? comma : end;
+    const Symbol* symbol = (nameEnd - name > VARIABLE_NAME_MAX)
+                               ? NULL
+                               : symbol_lookup_name(name, nameEnd - name);
+    if (symbol == NULL || symbol->isLoop == 0 ||
+        dimensions == SWEEP_DIMENSIONS_MAX) {
+      return 0;
+    }
+    const Loop* loopVariable = &(*loops)[symbol->index];
+    for (int i = 0; i < dimensions; ++i) {
+      if (sweepLoops[i] == loopVariable) {
+        return 0;
+      }
+    }
+    const long steps = range_steps(loopVariable);
+    if (steps > LONG_MAX / *points) {
+      return 0;
+    }
+    *points *= steps;
+    sweepLoops[dimensions++] = loopVariable;
+    if (comma == NULL) {
+      return dimensions;
+    }
+    name = comma;
+  }
+}
+
+/**
+ * sweep_handler()
+ * ----------------
+ * Processes a @sweep command of the form "@sweep <vars> <expression>", which
+ *evaluates the expression at every point of the grid formed by the
+ *comma-separated loop variables vars, printing each result in the format
+ *Result = <result> when <var> = <value>, <var> = <value>... A @sum, @min, @max
+ *or @mean command of the same form prints only the sum, minimum, maximum or
+ *mean of the results, in the format Result = <result>.
+ *
+ * line: The command, with no leading whitespace. It need not be
+ *null-terminated.
+ * length: The number of characters in line.
+ * strippedLine: Null-terminated copy of line with whitespace removed.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ * Errors: If the command is malformed, vars does not name distinct loop
+ *variables, or the expression is invalid, prints an error message to stderr.
+ *
+ **/
+void sweep_handler(const char line[], size_t length, char strippedLine[],
+                   Def** defs, const int* defSize, Loop** loops,
+                   int sigFigures) {
+  int reduction = REDUCE_NONE;
+  while (!line_starts_with(line, length, sweepCommands[reduction])) {
+    reduction++;
+  }
+  const char* names;
+  size_t namesLength;
+  char* expression =
+      command_arguments(line, length, strippedLine,
+                        strlen(sweepCommands[reduction]), 1, &names,
+                        &namesLength);
+  const Loop* sweepLoops[SWEEP_DIMENSIONS_MAX];
+  long points;
+  const int dimensions =
+      expression ? sweep_loops(names, namesLength, loops, sweepLoops, &points)
+                 : 0;
+  if (dimensions == 0) {
+    report_error();
+    return;
+  }
+
+  // Each worker compiles its own copy, so only check the expression here
+  double loopValues[SWEEP_DIMENSIONS_MAX];
+  Program* program;
+  te_expr* expr = compile_range(expression, sweepLoops, dimensions, loopValues,
+                                defs, defSize, &program);
+  if (expr == NULL) {
+    report_error();
+    return;
+  }
+  program_free(program);
+  te_free(expr);
+  sweep_evaluate(expression, sweepLoops, dimensions, points, reduction, defs,
+                 defSize, sigFigures);
+}
+
+/**
+ * line_dispatch()
+ * ----------------
+ * Processes a line of input from stdin or a file, determining whether it is an
+ *expression, an assignment, or a command.
+ *
+ * line: The line to process, without its newline. It need not be
+ *null-terminated, so it can point straight into a read buffer or mapped file.
+ * length: The number of characters in line.
+ * defs: Pointer to an array of defined variables.
+ * defSize: Pointer to an integer representing the number of defined variables.
+ * loops: Pointer to an array of loop variables.
+ * loopSize: Pointer to an integer representing the number of loop variables.
+ * sigFigures: The number of significant figures to use when evaluating
+ *expressions.
+ *
+ * Returns: void
+ *
+ * Errors: If the line contains an invalid assignment or expression, an error
+ *message is printed to stderr.
+ *
+ **/
+void line_dispatch(const char line[], size_t length, Def** defs, int* defSize,
+                   Loop** loops, int* loopSize, int sigFigures) {
+  // Strip white space into scratch memory and classify the line in one pass
+  char* strippedLine = arena_alloc(&lineArena, length + 1);
+  LineScan scan;
+  scan_line(line, length, strippedLine, &scan);
+
+  // Clients of a server cannot reach its files
+  if (serveSession && (scan.kind == LINE_SAVE || scan.kind == LINE_LOAD ||
+                       scan.kind == LINE_CSV || scan.kind == LINE_BINARY)) {
+    report_error();
+    return;
+  }
+
+  switch (scan.kind) {
+    case LINE_BLANK:
+      // Ignore lines that are commented out or blank
+      break;
+    case LINE_PRINT:
+      variable_print(defs, defSize, loops, loopSize, sigFigures);
+      break;
+    case LINE_RANGE:
+      range_handler(line, scan.length, strippedLine, defs, defSize, loops,
+                    sigFigures);
+      break;
+    case LINE_SAVE:
+    case LINE_LOAD:
+      state_handler(line, scan.length, scan.kind, defs, defSize, loops,
+                    loopSize, sigFigures);
+      break;
+    case LINE_CSV:
+    case LINE_BINARY:
+      table_handler(line, scan.length, strippedLine, scan.kind, defs, defSize,
+                    sigFigures);
+      break;
+    case LINE_SWEEP:
+      sweep_handler(line, scan.length, strippedLine, defs, defSize, loops,
+                    sigFigures);
+      break;
+    case LINE_EXPRESSION:
+      expression_handler(strippedLine, defs, defSize, sigFigures);
+      break;
+    case LINE_ASSIGNMENT:
+      assignment_handler(scan.name, scan.expression, defs, defSize,
+                         sigFigures);
+      break;
+    default:
+      report_error();
+      break;
+  }
+}
+
+/**
+ * line_handler()
+ * ----------------
+ * Processes a line of input with line_dispatch(), then releases the scratch
+ *memory it used. Time not spent in a later stage counts as stripping and
+ *classifying the line for --stats.
+ *
+ * line: The line to process, without its newline. It need not be
+ *null-terminated.
+ * length: The number of characters in line.
+ * defs: Pointer to an array of defined variables.
+ * defSize: Pointer to an integer representing the number of defined variables.
+ * loops: Pointer to an array of loop variables.
+ * loopSize: Pointer to an integer representing the number of loop variables.
+ * sigFigures: The number of significant figures to use when evaluating
+ *expressions.
+ *
+ * Returns: void
+ *
+ **/
+void line_handler(const char line[], size_t length, Def** defs, int* defSize,
+                  Loop** loops, int* loopSize, int sigFigures) {
+  stats_begin(STAGE_CLASSIFY);
+  line_dispatch(line, length, defs, defSize, loops, loopSize, sigFigures);
+  arena_reset(&lineArena);
+  stats_end(1);
+}
+
+/**
+ * reader_init()
+ * ----------------
+ * Prepares a LineReader to read from an open file.
+ *
+ * reader: The LineReader to initialise.
+ * fd: The file descriptor to read from.
+ *
+ * Returns: void
+ *
+ **/
+void reader_init(LineReader* reader, int fd) {
+  reader->fd = fd;
+  reader->capacity = READ_BLOCK_SIZE;
+  // One extra byte so that a final line without a newline can be terminated
+  reader->buffer = malloc(reader->capacity + 1);
+  reader->start = 0;
+  reader->end = 0;
+  reader->eof = 0;
+}
+
+/**
+ * reader_free()
+ * ----------------
+ * Frees the buffer of a LineReader.
+ *
+ * reader: The LineReader to free.
+ *
+ * Returns: void
+ *
+ **/
+void reader_free(LineReader* reader) {
+  free(reader->buffer);
+  reader->buffer = NULL;
+}
+
+/**
+ * reader_fill()
+ * ----------------
+ * Moves unread input to the front of the buffer, growing the buffer if a
+ *single line fills it, and then reads the next block of input.
+ *
+ * reader: The LineReader to fill.
+ *
+ * Returns: void
+ *
+ **/
+void reader_fill(LineReader* reader) {
+  const size_t unread = reader->end - reader->start;
+  memmove(reader->buffer, reader->buffer + reader->start, unread);
+  reader->start = 0;
+  reader->end = unread;
+
+  if (reader->end == reader->capacity) {
+    reader->capacity *= 2;
+    reader->buffer = realloc(reader->buffer, reader->capacity + 1);
+  }
+
+  ssize_t numRead;
+  do {
+    numRead = read(reader->fd, reader->buffer + reader->end,
+                   reader->capacity - reader->end);
+  } while (numRead < 0 && errno == EINTR);
+
+  if (numRead <= 0) {
+    reader->eof = 1;
+  } else {
+    reader->end += numRead;
+  }
+}
+
+/**
+ * batch_writer()
+ * ----------------
+ * Finds the slot recording the latest assignment in the batch to a name.
+ *
+ * name: The name to find, which need not be null-terminated.
+ * length: The number of characters in name.
+ *
+ * Returns: The index of the slot in batch.writers, which has a NULL name if
+ *the batch does not assign to name, or -1 if name is too long to be a
+ *variable.
+ *
+ **/
+int batch_writer(const char* name, size_t length) {
+  if (length > VARIABLE_NAME_MAX) {
+    return -1;
+  }
+  char copy[VARIABLE_NAME_SIZE];
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+
+  unsigned int slot = hash_string(copy) & (WRITER_TABLE_SIZE - 1);
+  while (batch.writers[slot].name != NULL &&
+         strcmp(batch.writers[slot].name, copy) != 0) {
+    slot = (slot + 1) & (WRITER_TABLE_SIZE - 1);
+  }
+  return slot;
+}
+
+/**
+ * batch_add_source()
+ * ----------------
+ * Records where one name read by the newest job in the batch comes from.
+ *
+ * source: An earlier job in the batch if >= 0, or -1 - i for defs[i].
+ *
+ * Returns: void
+ *
+ **/
+void batch_add_source(int source) {
+  if (batch.sourceCount == batch.sourceCapacity) {
+    batch.sourceCapacity =
+        batch.sourceCapacity ? batch.sourceCapacity * 2 : JOB_BATCH_LINES;
+    batch.sources = realloc(batch.sources, batch.sourceCapacity * sizeof(int));
+  }
+  batch.sources[batch.sourceCount++] = source;
+}
+
+/**
+ * batch_add_line()
+ * ----------------
+ * Adds a line to the batch, recording which variables it reads and writes.
+ *Each name read depends on the latest earlier assignment to it in the batch, if
+ *any, and an assignment also depends on the previous assignment to its
+ *variable. The level of the line is one more than that of anything it depends
+ *on.
+ *
+ * line: The line to add, which need not be null-terminated.
+ * length: The number of characters in line.
+ *
+ * Returns: 1 if the line was added, or 0 if it must instead be handled in
+ *order by line_handler(), which is the case for commands, assignments in
+ *reactive mode and lines that do not fit in the text of a non-empty batch.
+ *
+ **/
+int batch_add_line(const char* line, size_t length) {
+  if (length > 0 && line[0] == '@') {
+    return 0;
+  }
+
+  // Make sure the stripped line fits without moving the text of the batch
+  if (batch.textUsed + length + 1 > batch.textCapacity) {
+    if (batch.jobCount > 0) {
+      return 0;
+    }
+    batch.textCapacity =
+        (length + 1 > JOB_TEXT_SIZE) ? length + 1 : JOB_TEXT_SIZE;
+    batch.text = realloc(batch.text, batch.textCapacity);
+  }
+  char* stripped = batch.text + batch.textUsed;
+  LineScan scan;
+  scan_line(line, length, stripped, &scan);
+
+  // In reactive mode an assignment can recompute any number of Defs
+  if (reactiveEnabled && scan.kind == LINE_ASSIGNMENT) {
+    return 0;
+  }
+
+  LineJob* job = &batch.jobs[batch.jobCount];
+  job->line = outputLine;
+  job->kind = scan.kind;
+  job->expression = scan.expression;
+  job->name = scan.name;
+  job->writes = 0;
+  job->previous = -1;
+  job->target = -1;
+  job->sourceStart = batch.sourceCount;
+  job->sourceCount = 0;
+  job->cacheable = 1;
+  job->level = 0;
+
+  // The line cannot be a command, as it does not start with '@'
+  if (job->kind == LINE_ASSIGNMENT && valid_variable_name(job->name) == 0) {
+    job->kind = LINE_INVALID;
+  }
+
+  if (job->kind == LINE_EXPRESSION || job->kind == LINE_ASSIGNMENT) {
+    // Record what the expression reads
+    const char* next = job->expression;
+    const char* name;
+    size_t nameLength;
+    while ((name = next_name(&next, &nameLength)) != NULL) {
+      const int slot = batch_writer(name, nameLength);
+      const Writer* writer = (slot >= 0) ? &batch.writers[slot] : NULL;
+      const Symbol* symbol = symbol_lookup_name(name, nameLength);
+      if (writer != NULL && writer->name != NULL) {
+        batch_add_source(writer->job);
+        job->cacheable = 0;
+        if (batch.jobs[writer->job].level + 1 > job->level) {
+          job->level = batch.jobs[writer->job].level + 1;
+        }
+      } else if (symbol != NULL && symbol->isLoop == 0) {
+        batch_add_source(-1 - symbol->index);
+      } else {
+        continue;
+      }
+      job->sourceCount++;
+    }
+  }
+
+  if (job->kind == LINE_ASSIGNMENT) {
+    // Assignments to loop variables are printed but change nothing
+    const Symbol* symbol = symbol_lookup(job->name);
+    if (symbol == NULL || symbol->isLoop == 0) {
+      job->writes = 1;
+      job->target = symbol ? symbol->index : -1;
+      job->writerSlot = batch_writer(job->name, strlen(job->name));
+      Writer* writer = &batch.writers[job->writerSlot];
+      if (writer->name != NULL) {
+        job->previous = writer->job;
+        if (batch.jobs[writer->job].level + 1 > job->level) {
+          job->level = batch.jobs[writer->job].level + 1;
+        }
+      }
+      writer->name = job->name;
+      writer->job = batch.jobCount;
+    }
+  }
+
+  batch.textUsed += length + 1;
+  batch.jobCount++;
+  return 1;
+}
+
+/**
+ * evaluate_job()
+ * ----------------
+ * Evaluates the expression of a job in the same way as line_handler(), without
+ *changing any shared state. Names assigned earlier in the batch are bound to
+ *the values those assignments left. Expressions that only read Defs are taken
+ *from the expression cache or the worker's own cache, and otherwise compiled
+ *into the worker's cache.
+ *
+ * worker: The worker evaluating the job, whose scratch space is used.
+ * job: The job to evaluate.
+ *
+ * Returns: void
+ *
+ **/
+void evaluate_job(Worker* worker, LineJob* job) {
+  if (job->kind != LINE_EXPRESSION && job->kind != LINE_ASSIGNMENT) {
+    return;
+  }
+
+  if (job->cacheable) {
+    const unsigned int bucket =
+        hash_string(job->expression) % EXPR_CACHE_BUCKETS;
+    const CacheEntry* cached = expr_cache_find(job->expression, bucket);
+    for (cached = cached ? cached : worker->cache[bucket]; cached != NULL;
+         cached = cached->next) {
+      if (strcmp(cached->expression, job->expression) == 0) {
+        break;
+      }
+    }
+
+    if (cached == NULL) {
+      stats_begin(STAGE_COMPILE);
+      const int varCount = select_bindings(job->expression, &worker->vars,
+                                           &worker->varsCapacity);
+      int errPos;
+      CacheEntry* entry = arena_alloc(&worker->arena, sizeof(CacheEntry));
+      entry->expression = arena_strndup(&worker->arena, job->expression,
+                                        strlen(job->expression));
+      entry->compiled =
+          te_compile(job->expression, worker->vars, varCount, &errPos);
+      entry->program = NULL;
+      entry->next = worker->cache[bucket];
+      worker->cache[bucket] = entry;
+      cached = entry;
+      stats_end(1);
+    }
+    stats_begin(STAGE_EVAL);
+    job->result = cache_eval(cached);
+    stats_end(1);
+  } else {
+    // Bind every name to its value as of this line
+    stats_begin(STAGE_COMPILE);
+    int varCount = 0;
+    for (int i = 0; i < job->sourceCount; ++i) {
+      const int source = batch.sources[job->sourceStart + i];
+      if (source < 0) {
+        varCount = push_binding(&worker->vars, &worker->varsCapacity,
+                                varCount, teVars[-1 - source]);
+      } else if (batch.jobs[source].defined) {
+        te_variable binding = {batch.jobs[source].name,
+                               &batch.jobs[source].value, TE_VARIABLE, NULL};
+        varCount = push_binding(&worker->vars, &worker->varsCapacity,
+                                varCount, binding);
+      }
+    }
+    int errPos;
+    te_expr* expr =
+        te_compile(job->expression, worker->vars, varCount, &errPos);
+    stats_end(1);
+    stats_begin(STAGE_EVAL);
+    job->result = expr ? te_eval(expr) : NAN;
+    stats_end(expr != NULL);
+    te_free(expr);
+  }
+  job->status = isnan(job->result) ? JOB_ERROR : JOB_RESULT;
+
+  // A failed assignment leaves the variable as it was
+  if (job->writes) {
+    if (job->status == JOB_RESULT) {
+      job->value = job->result;
+      job->defined = 1;
+    } else if (job->previous >= 0) {
+      job->value = batch.jobs[job->previous].value;
+      job->defined = batch.jobs[job->previous].defined;
+    } else if (job->target >= 0) {
+      job->value = *(const double*)teVars[job->target].address;
+      job->defined = 1;
+    } else {
+      job->defined = 0;
+    }
+  }
+}
+
+/**
+ * worker_run()
+ * ----------------
+ * Thread entry point that evaluates a worker's slice of a level of the batch.
+ *
+ * arg: Pointer to the Worker.
+ *
+ * Returns: NULL
+ *
+ **/
+void* worker_run(void* arg) {
+  Worker* worker = arg;
+  for (int i = 0; i < worker->jobCount; ++i) {
+    evaluate_job(worker, &batch.jobs[worker->order[i]]);
+  }
+  return NULL;
+}
+
+/**
+ * run_level()
+ * ----------------
+ * Evaluates the jobs of one level of the batch, which do not depend on each
+ *other, across worker threads. Small levels are evaluated on the calling
+ *thread.
+ *
+ * order: The indices of the jobs in the level.
+ * jobCount: The number of jobs in the level.
+ * jobs: The maximum number of threads to use.
+ *
+ * Returns: The number of workers used.
+ *
+ **/
+int run_level(const int* order, int jobCount, int jobs) {
+  int threadCount = jobCount / JOB_MIN_LINES;
+  threadCount = (threadCount < jobs) ? threadCount : jobs;
+  if (threadCount <= 1) {
+    workers[0].order = order;
+    workers[0].jobCount = jobCount;
+    worker_run(&workers[0]);
+    return 1;
+  }
+
+  // Give each thread an even, contiguous slice of the level
+  int first = 0;
+  for (int i = 0; i < threadCount; ++i) {
+    const int last = (int)((long)jobCount * (i + 1) / threadCount);
+    workers[i].order = order + first;
+    workers[i].jobCount = last - first;
+    pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    first = last;
+  }
+  for (int i = 0; i < threadCount; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  return threadCount;
+}
+
+/**
+ * run_batch()
+ * ----------------
+ * Evaluates the batch a level at a time, so that independent lines and chains
+ *of assignments run concurrently. Results, errors and assignments are then
+ *printed and applied in input order, exactly as line_handler() would have, and
+ *the batch is emptied.
+ *
+ * jobs: The maximum number of threads to use.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * sigFigures: Number of significant figures to use when printing.
+ *
+ * Returns: void
+ *
+ **/
+void run_batch(int jobs, Def** defs, int* defSize, int sigFigures) {
+  if (batch.jobCount == 0) {
+    return;
+  }
+
+  // Workers only read the bindings and memoised values, so they must be
+  // current beforehand
+  update_bindings(*defs, *defSize);
+  memo_refresh_all();
+
+  // Sort the jobs by level, keeping input order within each level
+  int levelCount = 0;
+  for (int i = 0; i < batch.jobCount; ++i) {
+    levelCount = (batch.jobs[i].level >= levelCount) ? batch.jobs[i].level + 1
+                                                     : levelCount;
+  }
+  memset(batch.levelCounts, 0, (levelCount + 1) * sizeof(int));
+  for (int i = 0; i < batch.jobCount; ++i) {
+    batch.levelCounts[batch.jobs[i].level + 1]++;
+  }
+  for (int level = 0; level < levelCount; ++level) {
+    batch.levelCounts[level + 1] += batch.levelCounts[level];
+  }
+  for (int i = 0; i < batch.jobCount; ++i) {
+    batch.order[batch.levelCounts[batch.jobs[i].level]++] = i;
+  }
+
+  // levelCounts now holds the end of each level in order
+  int workersUsed = 1;
+  for (int level = 0, first = 0; level < levelCount; ++level) {
+    const int last = batch.levelCounts[level];
+    const int used = run_level(batch.order + first, last - first, jobs);
+    workersUsed = (used > workersUsed) ? used : workersUsed;
+    first = last;
+  }
+
+  // Move what the workers compiled into the cache for later batches
+  for (int i = 0; i < workersUsed; ++i) {
+    for (int bucket = 0; bucket < EXPR_CACHE_BUCKETS; ++bucket) {
+      for (const CacheEntry* entry = workers[i].cache[bucket]; entry != NULL;
+           entry = entry->next) {
+        expr_cache_insert(entry->expression, entry->compiled);
+      }
+      workers[i].cache[bucket] = NULL;
+    }
+    arena_reset(&workers[i].arena);
+  }
+
+  const unsigned long line = outputLine;
+  for (int i = 0; i < batch.jobCount; ++i) {
+    const LineJob* job = &batch.jobs[i];
+    outputLine = job->line;
+    if (job->kind == LINE_INVALID ||
+        (job->kind != LINE_BLANK && job->status == JOB_ERROR)) {
+      report_error();
+    } else if (job->kind == LINE_EXPRESSION) {
+      print_expression(job->result, sigFigures);
+    } else if (job->kind == LINE_ASSIGNMENT) {
+      handle_new_variable(defs, defSize, job->name, job->result, sigFigures);
+    }
+    output_line_done();
+
+    if (job->writes) {
+      batch.writers[job->writerSlot].name = NULL;
+    }
+  }
+  outputLine = line;
+  batch.jobCount = 0;
+  batch.textUsed = 0;
+  batch.sourceCount = 0;
+}
+
+/**
+ * lines_handler()
+ * ----------------
+ * Processes each complete line of a buffer of input in place. With more than
+ *one job, lines are gathered into batches that are evaluated in parallel by
+ *run_batch(), and only commands are handled in order. The last batch may be
+ *left unfinished, so callers must call run_batch() before waiting for more
+ *input or returning.
+ *
+ * text: The input, which need not be null-terminated.
+ * size: The number of characters in text.
+ * final: 1 if no more input follows, so that a final line without a newline is
+ *processed as normal, or 0 if it should be left for later.
+ * lineNumber: Pointer to the number of the next line, which is advanced past
+ *every line processed.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when processing.
+ * jobs: The maximum number of threads to evaluate lines with.
+ *
+ * Returns: The number of characters processed, which ends after the last line
+ *processed.
+ *
+ **/
+size_t lines_handler(const char* text, size_t size, int final,
+                     unsigned long* lineNumber, Def** defs, int* defSize,
+                     Loop** loops, int* loopSize, int sigFigures, int jobs) {
+  const char* line = text;
+  const char* textEnd = text + size;
+
+  while (line < textEnd) {
+    stats_begin(STAGE_READ);
+    const char* newline = memchr(line, '\n', textEnd - line);
+    const size_t length =
+        newline ? (size_t)(newline - line) : (size_t)(textEnd - line);
+    stats_end(1);
+    if (newline == NULL && !final) {
+      break;
+    }
+    outputLine = *lineNumber;
+
+    if (jobs > 1) {
+      if (batch.jobCount == JOB_BATCH_LINES) {
+        run_batch(jobs, defs, defSize, sigFigures);
+      }
+      stats_begin(STAGE_CLASSIFY);
+      const int added = batch_add_line(line, length);
+      stats_end(added);
+      if (added) {
+        line += length + 1;
+        (*lineNumber)++;
+        continue;
+      }
+      if (batch.jobCount > 0) {
+        // Everything before this line must be finished before it is retried
+        run_batch(jobs, defs, defSize, sigFigures);
+        continue;
+      }
+    }
+    line_handler(line, length, defs, defSize, loops, loopSize, sigFigures);
+    output_line_done();
+    line += length + 1;
+    (*lineNumber)++;
+  }
+  return (line < textEnd) ? (size_t)(line - text) : size;
+}
+
+/**
+ * mapped_file_handler()
+ * ----------------
+ * Splits a file mapped into memory into lines and processes each line in
+ *place with lines_handler().
+ *
+ * mapping: The contents of the file.
+ * size: The size of the file in bytes.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when processing.
+ * jobs: The maximum number of threads to evaluate lines with.
+ *
+ * Returns: void
+ *
+ **/
+void mapped_file_handler(const char* mapping, size_t size, Def** defs,
+                         int* defSize, Loop** loops, int* loopSize,
+                         int sigFigures, int jobs) {
+  unsigned long lineNumber = 1;
+  lines_handler(mapping, size, 1, &lineNumber, defs, defSize, loops, loopSize,
+                sigFigures, jobs);
+  run_batch(jobs, defs, defSize, sigFigures);
+}
+
+/**
+ * stream_handler()
+ * ----------------
+ * Processes input that cannot be mapped, such as a pipe or a socket, in an
+ *event loop driven by poll(). Each time round, everything that has already
+ *arrived is read ahead into a LineReader, up to a buffer full, and every
+ *complete line read is then handled by lines_handler(), so a burst of lines is
+ *batched across --jobs threads just as a mapped file is. Only once the input
+ *has run dry are the last batch finished and the output flushed, before
+ *waiting for more. The descriptor's flags are shared with whoever else has it
+ *open, such as the shell or the producer of a pipe, so it is left blocking and
+ *is only read when poll() reports it ready.
+ *
+ * fd: The file descriptor to read from.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when processing.
+ * jobs: The maximum number of threads to evaluate lines with.
+ *
+ * Returns: void
+ *
+ **/
+void stream_handler(int fd, Def** defs, int* defSize, Loop** loops,
+                    int* loopSize, int sigFigures, int jobs) {
+  LineReader reader;
+  reader_init(&reader, fd);
+  unsigned long lineNumber = 1;
+  struct pollfd input = {fd, POLLIN, 0};
+  while (1) {
+    // Read ahead whatever has arrived, stopping once the buffer is full. The
+    // first read only waits if nothing was ready when the loop last waited
+    stats_begin(STAGE_READ);
+    do {
+      reader_fill(&reader);
+    } while (!reader.eof && reader.end < reader.capacity &&
+             poll(&input, 1, 0) > 0);
+    stats_end(0);
+
+    reader.start += lines_handler(
+        reader.buffer + reader.start, reader.end - reader.start, reader.eof,
+        &lineNumber, defs, defSize, loops, loopSize, sigFigures, jobs);
+    if (reader.eof) {
+      break;
+    }
+
+    // Everything that arrived has been handled, so catch up before waiting
+    if (reader.end < reader.capacity && poll(&input, 1, 0) == 0) {
+      run_batch(jobs, defs, defSize, sigFigures);
+      output_flush();
+      while (poll(&input, 1, -1) < 0 && errno == EINTR) {
+      }
+    }
+  }
+  run_batch(jobs, defs, defSize, sigFigures);
+
+  reader_free(&reader);
+}
+
+/**
+ * file_handler()
+ * ----------------
+ * Reads a file line by line and processes each line accordingly. Regular files
+ *are mapped into memory and processed in place; anything else, such as a pipe,
+ *is handled by stream_handler().
+ *
+ * fileName: Null-terminated string containing the name of the file to read.
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when processing.
+ * options: The settings given by other command line options.
+ *
+ * Returns: void
+ *
+ * Errors: If the file cannot be opened, prints an error and exits.
+ *
+ **/
+void file_handler(char fileName[], Def** defs, int* defSize, Loop** loops,
+                  int* loopSize, int sigFigures, const Options* options) {
+  FILE* file = fopen(fileName, "r");
+
+  // Map regular files, falling back to reading them if mapping fails. The file
+  // is only opened once, so that nothing is lost from a pipe
+  size_t size;
+  char* mapping = map_descriptor(fileno(file), &size);
+  if (mapping != NULL) {
+    mapped_file_handler(mapping, size, defs, defSize, loops, loopSize,
+                        sigFigures, options->jobs);
+    munmap(mapping, size);
+    fclose(file);
+    return;
+  }
+
+  stream_handler(fileno(file), defs, defSize, loops, loopSize, sigFigures,
+                 options->jobs);
+  fclose(file);
+}
+
+/**
+ * editor_restore()
+ * ----------------
+ * Puts the terminal back the way it was before the line editor started, if it
+ *is running. Registered with atexit() so the terminal is also restored on
+ *exit() from anywhere.
+ *
+ * Returns: void
+ *
+ **/
+void editor_restore(void) {
+  if (editorRunning) {
+    editorRunning = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editorTermios);
+  }
+}
+
+/**
+ * editor_signal()
+ * ----------------
+ * Called when the program is hung up on, interrupted or terminated while the
+ *line editor is running, so that the terminal is restored before the signal
+ *takes effect.
+ *
+ * signalNumber: The number of the signal received.
+ *
+ * Returns: void
+ *
+ **/
+void editor_signal(int signalNumber) {
+  editor_restore();
+  signal(signalNumber, SIG_DFL);
+  raise(signalNumber);
+}
+
+/**
+ * editor_refresh()
+ * ----------------
+ * Redraws the line being edited and puts the cursor back where it belongs.
+ *
+ * editor: The line editor.
+ *
+ * Returns: void
+ *
+ **/
+void editor_refresh(const LineEditor* editor) {
+  output_text("\r", 1);
+  output_text(editor->line, editor->length);
+  output_string("\x1b[K\r");
+  if (editor->cursor > 0) {
+    char move[DOUBLE_TEXT_SIZE];
+    output_text(move, snprintf(move, sizeof(move), "\x1b[%zuC",
+                               editor->cursor));
+  }
+  output_flush();
+}
+
+/**
+ * editor_set()
+ * ----------------
+ * Replaces the line being edited, leaving the cursor at its end.
+ *
+ * editor: The line editor.
+ * line: The new line, which need not be null-terminated.
+ * length: The number of characters in line.
+ *
+ * Returns: void
+ *
+ **/
+void editor_set(LineEditor* editor, const char* line, size_t length) {
+  if (length + 1 > editor->capacity) {
+    editor->capacity = length + 1;
+    editor->line = realloc(editor->line, editor->capacity);
+  }
+  memmove(editor->line, line, length);
+  editor->length = editor->cursor = length;
+}
+
+/**
+ * editor_insert()
+ * ----------------
+ * Inserts a character into the line being edited at the cursor.
+ *
+ * editor: The line editor.
+ * c: The character to insert.
+ *
+ * Returns: void
+ *
+ **/
+void editor_insert(LineEditor* editor, char c) {
+  if (editor->length + 1 >= editor->capacity) {
+    editor->capacity *= 2;
+    editor->line = realloc(editor->line, editor->capacity);
+  }
+  memmove(editor->line + editor->cursor + 1, editor->line + editor->cursor,
+          editor->length - editor->cursor);
+  editor->line[editor->cursor++] = c;
+  editor->length++;
+}
+
+/**
+ * editor_delete()
+ * ----------------
+ * Deletes characters from the line being edited.
+ *
+ * editor: The line editor.
+ * from: The first character to delete.
+ * to: One past the last character to delete.
+ *
+ * Returns: void
+ *
+ **/
+void editor_delete(LineEditor* editor, size_t from, size_t to) {
+  memmove(editor->line + from, editor->line + to, editor->length - to);
+  editor->length -= to - from;
+  editor->cursor = from;
+}
+
+/**
+ * editor_history()
+ * ----------------
+ * Moves through the history of entered lines, keeping what was being typed as
+ *a new line so that moving past the newest entry brings it back.
+ *
+ * editor: The line editor.
+ * direction: -1 to move to an older entry, or 1 to move to a newer one.
+ *
+ * Returns: void
+ *
+ **/
+void editor_history(LineEditor* editor, int direction) {
+  const int index = editor->historyIndex + direction;
+  if (index < 0 || index > editor->historyCount) {
+    return;
+  }
+  if (editor->historyIndex == editor->historyCount) {
+    free(editor->draft);
+    editor->draft = strndup(editor->line, editor->length);
+  }
+  editor->historyIndex = index;
+  const char* line = (index == editor->historyCount)
+                         ? editor->draft
+                         : editor->history[index];
+  editor_set(editor, line, strlen(line));
+}
+
+/**
+ * editor_remember()
+ * ----------------
+ * Adds an entered line to the history, unless it is blank or the same as the
+ *newest entry. Only the newest EDITOR_HISTORY_MAX lines are kept.
+ *
+ * editor: The line editor, whose line is the one entered.
+ *
+ * Returns: void
+ *
+ **/
+void editor_remember(LineEditor* editor) {
+  editor->historyIndex = editor->historyCount;
+  if (editor->length == 0 ||
+      (editor->historyCount > 0 &&
+       strlen(editor->history[editor->historyCount - 1]) == editor->length &&
+       memcmp(editor->history[editor->historyCount - 1], editor->line,
+              editor->length) == 0)) {
     return;
   }
-
-  // check if variable name is allowed
-  if (valid_variable_name(tokens[0]) == 0) {
-    fprintf(stderr, runningError);
-    return;
+  if (editor->historyCount == EDITOR_HISTORY_MAX) {
+    free(editor->history[0]);
+    memmove(editor->history, editor->history + 1,
+            (EDITOR_HISTORY_MAX - 1) * sizeof(char*));
+    editor->historyCount--;
   }
-
-  // If expression is valid and variable name allowed, handle appropriately
-  handle_new_variable(defs, defSize, loops, loopSize, tokens[0], result,
-                      sigFigures);
+  editor->history[editor->historyCount++] =
+      strndup(editor->line, editor->length);
+  editor->historyIndex = editor->historyCount;
 }
 
 /**
- * line_handler()
+ * editor_escape()
  * ----------------
- * Processes a line of input from stdin or a file, determining whether it is an
- *expression, an assignment, or a command.
+ * Handles a complete escape sequence sent by a cursor or editing key.
  *
- * line: Null-terminated string containing the line to process.
- * defs: Pointer to an array of defined variables.
- * defSize: Pointer to an integer representing the number of defined variables.
- * loops: Pointer to an array of loop variables.
- * loopSize: Pointer to an integer representing the number of loop variables.
- * sigFigures: The number of significant figures to use when evaluating
- *expressions.
+ * editor: The line editor, whose escape holds the sequence.
  *
  * Returns: void
  *
- * Errors: If the line contains an invalid assignment or expression, an error
- *message is printed to stderr.
+ **/
+void editor_escape(LineEditor* editor) {
+  const char key = editor->escape[editor->escapeLength - 1];
+  const char parameter = (editor->escapeLength > 3) ? editor->escape[2] : 0;
+  if (key == 'A') {
+    editor_history(editor, -1);
+  } else if (key == 'B') {
+    editor_history(editor, 1);
+  } else if (key == 'C' && editor->cursor < editor->length) {
+    editor->cursor++;
+  } else if (key == 'D' && editor->cursor > 0) {
+    editor->cursor--;
+  } else if (key == 'H' || (key == '~' && (parameter == '1' ||
+                                           parameter == '7'))) {
+    editor->cursor = 0;
+  } else if (key == 'F' || (key == '~' && (parameter == '4' ||
+                                           parameter == '8'))) {
+    editor->cursor = editor->length;
+  } else if (key == '~' && parameter == '3' &&
+             editor->cursor < editor->length) {
+    editor_delete(editor, editor->cursor, editor->cursor + 1);
+  }
+}
+
+/**
+ * editor_key()
+ * ----------------
+ * Handles one byte typed at the terminal. Besides inserting printable
+ *characters, it supports the arrow, Home, End and Delete keys, Backspace,
+ *Ctrl-A, Ctrl-E, Ctrl-B, Ctrl-F, Ctrl-P and Ctrl-N to move around the line and
+ *its history, Ctrl-K, Ctrl-U and Ctrl-W to delete to the end, the start or the
+ *previous word, Ctrl-L to clear the screen and Ctrl-C to abandon the line.
+ *
+ * editor: The line editor.
+ * c: The byte typed.
+ *
+ * Returns: EDITOR_ENTER if a line was entered, EDITOR_END if input was ended
+ *with Ctrl-D on an empty line, or EDITOR_EDITING otherwise.
  *
  **/
-void line_handler(char line[], Def** defs, int* defSize, Loop** loops,
-                  int* loopSize, int sigFigures) {
-  // Strip white space before processing line
-  // https://www.geeksforgeeks.org/c-program-to-trim-leading-white-spaces-from-string/
-  char strippedLine[strlen(line) + 1];
-  int writePtr = 0;
+int editor_key(LineEditor* editor, char c) {
+  // A carriage return and newline together, as some pastes send, are one
+  const int afterReturn = editor->afterReturn;
+  editor->afterReturn = c == '\r';
 
-  for (int readPtr = 0; line[readPtr] != '\0'; ++readPtr) {
-    if (!isspace(line[readPtr])) {
-      strippedLine[writePtr++] = line[readPtr];
+  if (editor->escapeLength > 0) {
+    editor->escape[editor->escapeLength++] = c;
+    const int introduced = editor->escape[1] == '[' || editor->escape[1] == 'O';
+    if (!introduced || (editor->escapeLength > 2 && c >= '@' && c <= '~') ||
+        editor->escapeLength == EDITOR_ESCAPE_MAX) {
+      if (introduced) {
+        editor_escape(editor);
+      }
+      editor->escapeLength = 0;
     }
+    return EDITOR_EDITING;
   }
-  strippedLine[writePtr] = '\0';
 
-  // Ignore lines that are commented out or blank
-  if (strippedLine[0] == '#' || strippedLine[0] == '\0') {
-    return;
+  switch (c) {
+    case '\n':
+      return afterReturn ? EDITOR_EDITING : EDITOR_ENTER;
+    case '\r':
+      return EDITOR_ENTER;
+    case EDITOR_KEY_ESCAPE:
+      editor->escape[editor->escapeLength++] = c;
+      break;
+    case EDITOR_KEY_CTRL_D:
+      if (editor->length == 0) {
+        return EDITOR_END;
+      }
+      if (editor->cursor < editor->length) {
+        editor_delete(editor, editor->cursor, editor->cursor + 1);
+      }
+      break;
+    case EDITOR_KEY_BACKSPACE:
+    case EDITOR_KEY_CTRL_H:
+      if (editor->cursor > 0) {
+        editor_delete(editor, editor->cursor - 1, editor->cursor);
+      }
+      break;
+    case EDITOR_KEY_CTRL_A:
+      editor->cursor = 0;
+      break;
+    case EDITOR_KEY_CTRL_E:
+      editor->cursor = editor->length;
+      break;
+    case EDITOR_KEY_CTRL_B:
+      editor->cursor -= editor->cursor > 0;
+      break;
+    case EDITOR_KEY_CTRL_F:
+      editor->cursor += editor->cursor < editor->length;
+      break;
+    case EDITOR_KEY_CTRL_P:
+      editor_history(editor, -1);
+      break;
+    case EDITOR_KEY_CTRL_N:
+      editor_history(editor, 1);
+      break;
+    case EDITOR_KEY_CTRL_K:
+      editor->length = editor->cursor;
+      break;
+    case EDITOR_KEY_CTRL_U:
+      editor_delete(editor, 0, editor->cursor);
+      break;
+    case EDITOR_KEY_CTRL_W: {
+      size_t from = editor->cursor;
+      while (from > 0 && editor->line[from - 1] == ' ') {
+        from--;
+      }
+      while (from > 0 && editor->line[from - 1] != ' ') {
+        from--;
+      }
+      editor_delete(editor, from, editor->cursor);
+      break;
+    }
+    case EDITOR_KEY_CTRL_L:
+      output_string("\x1b[H\x1b[2J");
+      break;
+    case EDITOR_KEY_CTRL_C:
+      output_string("^C\n");
+      editor->length = editor->cursor = 0;
+      editor->historyIndex = editor->historyCount;
+      break;
+    default:
+      if ((unsigned char)c >= ' ') {
+        editor_insert(editor, c);
+      }
+      break;
   }
+  return EDITOR_EDITING;
+}
 
-  // If line == @print, run initial_print
-  if (strcmp(line, print) == 0) {
-    variable_print(defs, defSize, loops, loopSize, sigFigures);
+/**
+ * editor_handler()
+ * ----------------
+ * Lets a user type lines at a terminal with line editing and a history of the
+ *lines entered, in an event loop over stdin driven by poll(). The terminal is
+ *put into raw mode so that every key reaches the editor, except that keys
+ *which send signals do so again while a line is processed, and is restored by
+ *editor_restore() however the program ends. stdin itself is left blocking, as
+ *its flags are shared with the shell, and is only read once poll() reports
+ *keys ready. Each time round,
+ *every key that has arrived is read at once and handled in order: a line is
+ *processed as soon as it is entered, so lines pasted together are processed
+ *one after another while the rest wait in the buffer, and the line being
+ *edited is redrawn once the keys run out.
+ *
+ * defs: Pointer to the array of defined variables.
+ * defSize: Pointer to the number of defined variables.
+ * loops: Pointer to the array of loop variables.
+ * loopSize: Pointer to the number of loop variables.
+ * sigFigures: Number of significant figures to use when processing.
+ *
+ * Returns: void
+ *
+ **/
+void editor_handler(Def** defs, int* defSize, Loop** loops, int* loopSize,
+                    int sigFigures) {
+  struct termios raw;
+  if (tcgetattr(STDIN_FILENO, &editorTermios) != 0) {
     return;
   }
+  raw = editorTermios;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_cflag |= CS8;
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+
+  // Ctrl-C and Ctrl-\ send their signals while a line is processed, so that a
+  // long command can still be stopped
+  struct termios processing = raw;
+  processing.c_lflag |= ISIG;
+  editorRunning = 1;
+  atexit(editor_restore);
+  signal(SIGHUP, editor_signal);
+  signal(SIGINT, editor_signal);
+  signal(SIGTERM, editor_signal);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
 
-  // Determine if the line is an assignment or an expression by counting the
-  // number of '=' present
-  int equalsCounter = 0;
-  for (size_t i = 1; i < strlen(strippedLine); ++i) {
-    if (strippedLine[i] == '=') {
-      equalsCounter++;
+  LineEditor editor;
+  memset(&editor, 0, sizeof(editor));
+  editor.capacity = EDITOR_LINE_SIZE;
+  editor.line = malloc(editor.capacity);
+  editor.history = malloc(EDITOR_HISTORY_MAX * sizeof(char*));
+  char keys[READ_BLOCK_SIZE];
+  struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+  int ended = 0;
+  while (!ended) {
+    while (poll(&input, 1, -1) < 0 && errno == EINTR) {
+    }
+    const ssize_t numRead = read(STDIN_FILENO, keys, sizeof(keys));
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    ended = numRead <= 0;
+
+    for (ssize_t i = 0; i < numRead && !ended; ++i) {
+      const int event = editor_key(&editor, keys[i]);
+      if (event == EDITOR_END) {
+        ended = 1;
+      } else if (event == EDITOR_ENTER) {
+        editor_refresh(&editor);
+        output_text("\n", 1);
+        output_flush();
+        editor_remember(&editor);
+        outputLine++;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &processing);
+        line_handler(editor.line, editor.length, defs, defSize, loops,
+                     loopSize, sigFigures);
+        output_line_done();
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+        editor.length = editor.cursor = 0;
+      }
+    }
+    if (!ended) {
+      editor_refresh(&editor);
     }
-  }
-  if (equalsCounter > 1) {
-    fprintf(stderr, runningError);
-    return;
   }
 
-  if (equalsCounter == 0) {
-    expression_handler(strippedLine, defs, defSize, sigFigures);
+  // A line left unfinished when input ends is processed as normal
+  editor_restore();
+  if (editor.length > 0) {
+    output_text("\n", 1);
+    outputLine++;
+    line_handler(editor.line, editor.length, defs, defSize, loops, loopSize,
+                 sigFigures);
+    output_line_done();
   }
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
 
-  if (equalsCounter == 1) {
-    assignment_handler(strippedLine, defs, defSize, loops, loopSize,
-                       sigFigures);
+  for (int i = 0; i < editor.historyCount; ++i) {
+    free(editor.history[i]);
   }
+  free(editor.history);
+  free(editor.draft);
+  free(editor.line);
 }
 
 /**
- * read_line()
+ * serve_stop()
  * ----------------
- * Reads a line from a file or stdin and returns a dynamically allocated string.
+ * Called when the server is interrupted or terminated, so that it removes its
+ *socket before exiting. Sessions already being served carry on until their
+ *clients disconnect.
  *
- * file: Pointer to a FILE stream to read from.
+ * signalNumber: The number of the signal received.
  *
- * Returns: A dynamically allocated string containing the line read from the
- *file. Caller must free the returned memory. Returns NULL on EOF.
- *
- * Errors: If memory allocation fails, returns NULL.
+ * Returns: void
  *
  **/
-char* read_line(FILE* file) {
-  int bufferSize = BUFFER_SIZE;
-
-  char* buffer = malloc(sizeof(char) * bufferSize);
-  int numRead = 0;
-  int next;
-
-  if (feof(file)) {
-    free(buffer);
-    return NULL;
-  }
-
-  while (1) {
-    next = fgetc(file);
-    if (next == EOF && numRead == 0) {
-      free(buffer);
-      return NULL;
-    }
-    if (numRead == bufferSize - 1) {
-      bufferSize *= 2;
-      buffer = realloc(buffer, sizeof(char) * bufferSize);
-    }
-    if (next == '\n' || next == EOF) {
-      buffer[numRead] = '\0';
-      break;
-    }
-    buffer[numRead++] = next;
-  }
-
-  char* result = strdup(buffer);
-  free(buffer);
-  return result;
+void serve_stop(int signalNumber) {
+  (void)signalNumber;
+  unlink(servePath);
+  _exit(0);
 }
 
 /**
- * file_handler()
+ * serve_handler()
  * ----------------
- * Reads a file line by line and processes each line accordingly.
+ * Listens on a Unix domain socket and serves each client that connects in a
+ *session of its own, until the server is stopped. Every session is a process
+ *forked from the server, so it starts from the variables given on the command
+ *line and shares whatever the server has already set up, while nothing one
+ *session defines or compiles can reach another. Only sessions return from
+ *this function, with the connection as their standard input, output and
+ *error, and are then handled like input typed by a user, except that the
+ *commands that read or write files are refused. The socket is only
+ *accessible to the user running the server.
  *
- * fileName: Null-terminated string containing the name of the file to read.
- * defs: Pointer to the array of defined variables.
- * defSize: Pointer to the number of defined variables.
- * loops: Pointer to the array of loop variables.
- * loopSize: Pointer to the number of loop variables.
- * sigFigures: Number of significant figures to use when processing.
+ * path: The path to create the socket at. A socket already there, such as one
+ *left behind by an earlier server, is replaced.
  *
  * Returns: void
  *
- * Errors: If the file cannot be opened, prints an error and exits.
+ * Errors: If the socket cannot be created, or accepting connections fails for
+ *good, prints an error and exits with code 20. If a session cannot be started,
+ *or connections cannot be accepted for lack of descriptors or memory, prints
+ *an error and carries on, waiting a while before accepting again in the
+ *latter case.
  *
  **/
-void file_handler(char fileName[], Def** defs, int* defSize, Loop** loops,
-                  int* loopSize, int sigFigures) {
-  FILE* file = fopen(fileName, "r");
+void serve_handler(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, serveError, path);
+    exit(SERVE_CODE);
+  }
+  strcpy(address.sun_path, path);
 
-  // Send lines to read_line() to be read and then send to line_handler() to
-  // be processed
-  char* line;
-  while ((line = read_line(file)) != NULL) {
-    line_handler(line, defs, defSize, loops, loopSize, sigFigures);
-    free(line);
+  struct stat pathStat;
+  if (lstat(path, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode)) {
+    unlink(path);
+  }
+  // Only the user running the server may connect to it
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  const mode_t mask = umask(SERVE_UMASK);
+  const int bound =
+      listener >= 0 &&
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0;
+  umask(mask);
+  if (!bound || listen(listener, SERVE_BACKLOG) != 0) {
+    fprintf(stderr, serveError, path);
+    exit(SERVE_CODE);
   }
 
-  fclose(file);
+  // Finished sessions are reaped by the system
+  servePath = path;
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGINT, serve_stop);
+  signal(SIGTERM, serve_stop);
+
+  while (1) {
+    const int client = accept(listener, NULL, NULL);
+    if (client < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+      continue;
+    }
+    if (client < 0 && (errno == EMFILE || errno == ENFILE ||
+                       errno == ENOBUFS || errno == ENOMEM)) {
+      // Out of descriptors or memory, so wait for sessions to end rather
+      // than spinning on accept()
+      fprintf(stderr, sessionError, path);
+      poll(NULL, 0, SERVE_RETRY_DELAY_MS);
+      continue;
+    }
+    if (client < 0) {
+      fprintf(stderr, serveError, path);
+      unlink(path);
+      exit(SERVE_CODE);
+    }
+
+    const pid_t session = fork();
+    if (session == 0) {
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      close(listener);
+      dup2(client, STDIN_FILENO);
+      dup2(client, STDOUT_FILENO);
+      dup2(client, STDERR_FILENO);
+      close(client);
+      serveSession = 1;
+      return;
+    }
+    // If a session cannot be started, its client is disconnected
+    if (session < 0) {
+      fprintf(stderr, sessionError, path);
+    }
+    close(client);
+  }
 }
 
 /**
@@ -522,7 +6871,7 @@ int valid_variable_name(const char* variableName) {
  * add_loop()
  * ----------------
  * Adds a new loop variable definition to the list of loop variables,
- *reallocating memory as needed.
+ *reallocating memory as needed, and indexes its name in the symbol table.
  *
  * loops: Pointer to the array of loop variables.
  * loopSize: Pointer to the number of loop variables.
@@ -536,13 +6885,15 @@ int valid_variable_name(const char* variableName) {
  **/
 void add_loop(Loop** loops, int* loopSize, const char* name, double start,
               double increment, double end) {
-  // Reallocate memory for the array of Defs (size increases by 1)
-  Loop* temp = realloc(*loops, (*loopSize + 1) * sizeof(Loop));
-
-  *loops = temp;
+  // Grow the array of Loops geometrically when it is full
+  if (*loopSize == loopCapacity) {
+    loopCapacity = loopCapacity ? loopCapacity * 2 : ARRAY_MIN_CAPACITY;
+    stats_allocation();
+    *loops = realloc(*loops, loopCapacity * sizeof(Loop));
+  }
 
   // Add new Loop to the end of the array
-  (*loops)[*loopSize].name = strdup(name);
+  (*loops)[*loopSize].name = symbol_insert(name, 1, *loopSize);
   (*loops)[*loopSize].start = start;
   (*loops)[*loopSize].increment = increment;
   (*loops)[*loopSize].end = end;
@@ -591,9 +6942,34 @@ int validate_loop_tokens(char* tokens[], int count) {
   }
 
   // https://www.tutorialspoint.com/c_standard_library/c_function_atof.htm
-  double start = atof(tokens[START]);
-  double increment = atof(tokens[INCREMENT]);
-  double end = atof(tokens[END]);
+  return valid_loop_values(atof(tokens[START]), atof(tokens[INCREMENT]),
+                           atof(tokens[END]));
+}
+
+/**
+ * valid_loop_values()
+ * ----------------
+ * Checks that the start, increment, and end values of a loop variable follow
+ *logical constraints.
+ *
+ * start: Start value of the loop.
+ * increment: Increment value of the loop.
+ * end: End value of the loop.
+ *
+ * Returns: 1 if the values are valid, or 0 if:
+ * - The increment value is 0, returns 0.
+ * - The start value is less than the end value, the increment must be positive;
+ *otherwise, returns 0.
+ * - The start value is greater than the end value, the increment must be
+ *negative; otherwise, returns 0.
+ * - Any of the values is not finite, or the loop takes more steps than a long
+ *can count, returns 0.
+ *
+ **/
+int valid_loop_values(double start, double increment, double end) {
+  if (!isfinite(start) || !isfinite(increment) || !isfinite(end)) {
+    return 0;
+  }
 
   // Increment must != 0 and if start == end, increment must == any value
   // other than zero
@@ -611,6 +6987,12 @@ int validate_loop_tokens(char* tokens[], int count) {
     return 0;
   }
 
+  // The number of steps must fit in a long (see range_steps())
+  const double quotient = (end - start) / increment;
+  if (!(quotient < (double)LONG_MAX)) {
+    return 0;
+  }
+
   return 1;
 }
 
@@ -628,7 +7010,7 @@ int validate_loop_tokens(char* tokens[], int count) {
  * - If delim == ',' and there is not exactly 3, returns 0.
  *
  **/
-int delim_check(char string[], char delim) {
+int delim_check(const char string[], char delim) {
   int delimCheck = 0;
   int stringLength = strlen(string);
 
@@ -670,21 +7052,17 @@ int delim_check(char string[], char delim) {
  *
  * Returns: 1 if the loop variable is successfully added, 0 if the definition is
  *invalid.
- * - If memory allocation fails, returns 0.
  * - If the variable definition does not contain the expected number of tokens,
  *returns 0.
  * - If the loop variable name or values are invalid, returns 0.
  *
  **/
 int loop_handler(char variable[], Loop** loops, int* loopSize) {
-  // Copy variable name into mutable string
-  char* variableCopy = strdup(variable);
-  if (!variableCopy) {
-    return 0;
-  }
+  // Copy variable name into mutable scratch memory
+  char* variableCopy = arena_strndup(&lineArena, variable, strlen(variable));
 
   // Ensure there is an appropriate number of seperators
-  if (delim_check(strdup(variable), ',') == 0) {
+  if (delim_check(variable, ',') == 0) {
     return 0;
   }
 
@@ -710,8 +7088,6 @@ int loop_handler(char variable[], Loop** loops, int* loopSize) {
   add_loop(loops, loopSize, tokens[0], atof(tokens[START]),
            atof(tokens[INCREMENT]), atof(tokens[END]));
 
-  free(variableCopy);
-
   return 1;
 }
 
@@ -719,7 +7095,7 @@ int loop_handler(char variable[], Loop** loops, int* loopSize) {
  * add_def()
  * ----------------
  * Adds a new variable definition to the list of defined variables, reallocating
- *memory as needed.
+ *memory as needed, and indexes its name in the symbol table.
  *
  * defs: Pointer to the array of defined variables.
  * defSize: Pointer to the number of defined variables.
@@ -730,11 +7106,18 @@ int loop_handler(char variable[], Loop** loops, int* loopSize) {
  *
  **/
 void add_def(Def** defs, int* defSize, const char* name, double value) {
-  // Reallocate memory for the array of Defs (size increases by 1)
-  *defs = realloc(*defs, (*defSize + 1) * sizeof(Def));
+  // Compiled expressions may refer to the old array, or not know this name
+  expr_cache_clear();
+
+  // Grow the array of Defs geometrically when it is full
+  if (*defSize == defCapacity) {
+    defCapacity = defCapacity ? defCapacity * 2 : ARRAY_MIN_CAPACITY;
+    stats_allocation();
+    *defs = realloc(*defs, defCapacity * sizeof(Def));
+  }
 
   // Add new Def structure at the end of the array
-  (*defs)[*defSize].name = strdup(name);
+  (*defs)[*defSize].name = symbol_insert(name, 0, *defSize);
   (*defs)[*defSize].value = value;
 
   (*defSize)++;
@@ -752,7 +7135,6 @@ void add_def(Def** defs, int* defSize, const char* name, double value) {
  *
  * Returns: 1 if the variable is successfully added, 0 if the definition is
  *invalid.
- * - If memory allocation fails, returns 0.
  * - If the variable definition does not contain exactly one '=' delimiter,
  *returns 0.
  * - If the variable name is invalid, returns 0.
@@ -760,14 +7142,11 @@ void add_def(Def** defs, int* defSize, const char* name, double value) {
  *
  **/
 int def_handler(char variable[], Def** defs, int* defSize) {
-  // Copy variable name into mutable string
-  char* variableCopy = strdup(variable);
-  if (!variableCopy) {
-    return 0;
-  }
+  // Copy variable name into mutable scratch memory
+  char* variableCopy = arena_strndup(&lineArena, variable, strlen(variable));
 
   // Ensure there is an appropriate number of seperators
-  if (delim_check(strdup(variable), '=') == 0) {
+  if (delim_check(variable, '=') == 0) {
     return 0;
   }
 
@@ -800,8 +7179,6 @@ int def_handler(char variable[], Def** defs, int* defSize) {
 
   add_def(defs, defSize, tokens[0], atof(tokens[1]));
 
-  free(variableCopy);
-
   return 1;
 }
 
@@ -821,25 +7198,18 @@ int def_handler(char variable[], Def** defs, int* defSize) {
  **/
 int unique_name_check(Def** defs, const int* defSize, Loop** loops,
                       const int* loopSize) {
-  // Initialise array to hold all variable names from defs and loops
-  int totalSize = *defSize + *loopSize;
-  char names[totalSize][VARIABLE_NAME_SIZE];
-
-  // Add all variable names from loops and defs into names
-  int index = 0;
+  // Every variable is indexed by name, so a variable is a duplicate exactly
+  // when its name resolves to a different symbol
   for (int i = 0; i < *defSize; ++i) {
-    strcpy(names[index++], (*defs)[i].name);
+    const Symbol* symbol = symbol_lookup((*defs)[i].name);
+    if (symbol->isLoop != 0 || symbol->index != i) {
+      return 0;
+    }
   }
   for (int i = 0; i < *loopSize; ++i) {
-    strcpy(names[index++], (*loops)[i].name);
-  }
-
-  // Check for duplicates in names
-  for (int i = 0; i < totalSize; ++i) {
-    for (int j = i + 1; j < totalSize; ++j) {
-      if (strcmp(names[i], names[j]) == 0) {
-        return 0;
-      }
+    const Symbol* symbol = symbol_lookup((*loops)[i].name);
+    if (symbol->isLoop != 1 || symbol->index != i) {
+      return 0;
     }
   }
 
@@ -894,6 +7264,99 @@ void sig_handler(int* sigCount, int* sigFigures, const char* input) {
   }
 }
 
+/**
+ * jobs_handler()
+ * ----------------
+ * Processes and validates the `--jobs` command-line argument, ensuring it is
+ *an integer between 1 and 64.
+ *
+ * jobsCount: Pointer to an integer tracking the number of times `--jobs` has
+ *been specified.
+ * jobs: Pointer to an integer where the validated number of jobs is stored.
+ * input: Null-terminated string containing the user-specified number of jobs.
+ *
+ * Returns: void
+ *
+ * Errors:
+ * - If `--jobs` is specified more than once, prints an error and exits with
+ *code 12.
+ * - If the provided value is not an integer between 1 and 64, prints an error
+ *and exits with code 12.
+ *
+ **/
+void jobs_handler(int* jobsCount, int* jobs, const char* input) {
+  (*jobsCount)++;
+
+  char* endptr;
+  const long value = strtol(input, &endptr, DECIMAL_BASE);
+  if (*jobsCount > 1 || !isdigit(input[0]) || *endptr != '\0' || value < 1 ||
+      value > JOBS_MAX) {
+    fprintf(stderr, usageError);
+    exit(USAGE_CODE);
+  }
+  *jobs = value;
+}
+
+/**
+ * backend_handler()
+ * ----------------
+ * Processes and validates the `--backend` command-line argument, which selects
+ *how expressions are evaluated.
+ *
+ * backendCount: Pointer to an integer tracking the number of times `--backend`
+ *has been specified.
+ * backend: Pointer to an integer where the selected BACKEND_* value is stored.
+ * input: Null-terminated string containing the name of the backend.
+ *
+ * Returns: void
+ *
+ * Errors: If `--backend` is specified more than once, or the name is not one
+ *of tree, bytecode or jit, prints an error and exits with code 12.
+ *
+ **/
+void backend_handler(int* backendCount, int* backend, const char* input) {
+  (*backendCount)++;
+
+  for (int i = 0; i < BACKEND_COUNT && *backendCount == 1; ++i) {
+    if (strcmp(input, backendNames[i]) == 0) {
+      *backend = i;
+      return;
+    }
+  }
+  fprintf(stderr, usageError);
+  exit(USAGE_CODE);
+}
+
+/**
+ * output_handler()
+ * ----------------
+ * Processes and validates the `--output` command-line argument, which selects
+ *whether results are printed as text or written as ndjson or binary records.
+ *
+ * outputCount: Pointer to an integer tracking the number of times `--output`
+ *has been specified.
+ * output: Pointer to an integer where the selected OUTPUT_* value is stored.
+ * input: Null-terminated string containing the name of the format.
+ *
+ * Returns: void
+ *
+ * Errors: If `--output` is specified more than once, or the name is not one
+ *of text, ndjson or binary, prints an error and exits with code 12.
+ *
+ **/
+void output_handler(int* outputCount, int* output, const char* input) {
+  (*outputCount)++;
+
+  for (int i = 0; i < OUTPUT_FORMAT_COUNT && *outputCount == 1; ++i) {
+    if (strcmp(input, outputNames[i]) == 0) {
+      *output = i;
+      return;
+    }
+  }
+  fprintf(stderr, usageError);
+  exit(USAGE_CODE);
+}
+
 /**
  * invalid_filename_check()
  * ----------------
@@ -932,19 +7395,24 @@ void invalid_filename_check(const int count, const int argc) {
  * loopSize: Pointer to the number of loop variables.
  * sigFigures: Pointer to the significant figures setting.
  * filePresent: Pointer to an integer flag indicating whether a file is present.
+ * options: Pointer to the settings given by other command line options.
  *
  * Returns: void
  *
  * Errors: If an invalid variable is encountered, prints an error and exits with
  *code 4. If several variables have the same name, prints an error and exits
- *with code 12.
+ *with code 12. If both a socket to serve on and an input file are given,
+ *prints an error and exits with code 12.
  *
  **/
 void check_validity(int argc, char* argv[], Def** defs, int* defSize,
                     Loop** loops, int* loopSize, int* sigFigures,
-                    int* filePresent) {
+                    int* filePresent, Options* options) {
   int count = 1;
   int sigCount = 0;
+  int jobsCount = 0;
+  int backendCount = 0;
+  int outputCount = 0;
 
   // Loop through arguments and check validity
   while (count < argc) {
@@ -956,6 +7424,7 @@ void check_validity(int argc, char* argv[], Def** defs, int* defSize,
         fprintf(stderr, invalidVariablesError);
         exit(INVALID_VARIABLES_CODE);
       }
+      arena_reset(&lineArena);
       count += 2;
     } else if (strcmp(argv[count], loop) == 0) {
       invalid_filename_check(count, argc);
@@ -964,6 +7433,7 @@ void check_validity(int argc, char* argv[], Def** defs, int* defSize,
         fprintf(stderr, invalidVariablesError);
         exit(INVALID_VARIABLES_CODE);
       }
+      arena_reset(&lineArena);
       count += 2;
     } else if (strcmp(argv[count], sig) == 0) {
       invalid_filename_check(count, argc);
@@ -971,11 +7441,65 @@ void check_validity(int argc, char* argv[], Def** defs, int* defSize,
       sig_handler(&sigCount, sigFigures, argv[count + 1]);
 
       count += 2;
-    } else if (strcmp(argv[count], sig) != 0 &&
-               strcmp(argv[count], loop) != 0 &&
-               strcmp(argv[count], def) != 0) {
-      // If there is an input that isn't sig, loop, or def at the end, it
-      // will be treated as a file
+    } else if (strcmp(argv[count], jobsOption) == 0) {
+      invalid_filename_check(count, argc);
+
+      jobs_handler(&jobsCount, &options->jobs, argv[count + 1]);
+
+      count += 2;
+    } else if (strcmp(argv[count], backendOption) == 0) {
+      invalid_filename_check(count, argc);
+
+      backend_handler(&backendCount, &options->backend, argv[count + 1]);
+
+      count += 2;
+    } else if (strcmp(argv[count], outputOption) == 0) {
+      invalid_filename_check(count, argc);
+
+      output_handler(&outputCount, &options->output, argv[count + 1]);
+
+      count += 2;
+    } else if (strcmp(argv[count], statsOption) == 0) {
+      // --stats takes no value and may only be given once
+      if (options->stats) {
+        fprintf(stderr, usageError);
+        exit(USAGE_CODE);
+      }
+      options->stats = 1;
+      count += 1;
+    } else if (strcmp(argv[count], reactiveOption) == 0) {
+      // --reactive takes no value and may only be given once
+      if (options->reactive) {
+        fprintf(stderr, usageError);
+        exit(USAGE_CODE);
+      }
+      options->reactive = 1;
+      count += 1;
+    } else if (strcmp(argv[count], serveOption) == 0) {
+      invalid_filename_check(count, argc);
+
+      // --serve may only be given once
+      if (options->serve != NULL) {
+        fprintf(stderr, usageError);
+        exit(USAGE_CODE);
+      }
+      options->serve = argv[count + 1];
+
+      count += 2;
+    } else if (strcmp(argv[count], stateOption) == 0) {
+      invalid_filename_check(count, argc);
+
+      // --state may only be given once
+      if (options->state != NULL) {
+        fprintf(stderr, usageError);
+        exit(USAGE_CODE);
+      }
+      options->state = argv[count + 1];
+
+      count += 2;
+    } else {
+      // If there is an input that isn't an option at the end, it will be
+      // treated as a file
       if (count == argc - 1) {
         file_validator(argv[count], filePresent);
       } else {
@@ -986,6 +7510,12 @@ void check_validity(int argc, char* argv[], Def** defs, int* defSize,
     }
   }
 
+  // Sessions served on a socket read from their clients, not a file
+  if (options->serve != NULL && *filePresent) {
+    fprintf(stderr, usageError);
+    exit(USAGE_CODE);
+  }
+
   // Check that variables all have unique names
   if (unique_name_check(defs, defSize, loops, loopSize) == 0) {
     fprintf(stderr, duplicateNameError);
@@ -1010,35 +7540,52 @@ void check_validity(int argc, char* argv[], Def** defs, int* defSize,
  **/
 void variable_print(Def** defs, const int* defSize, Loop** loops,
                     const int* loopSize, int sigFigures) {
-  // Create formats for printing with sigFigures values
-  char defFormat[DEF_FORMAT_SIZE];
-  snprintf(defFormat, sizeof(defFormat), "%%s = %%.%dg\n", sigFigures);
-
-  char loopFormat[LOOP_FORMAT_SIZE];
-  snprintf(loopFormat, sizeof(loopFormat),
-           "%%s = %%.%dg (%%.%dg, %%.%dg, %%.%dg)\n", sigFigures, sigFigures,
-           sigFigures, sigFigures);
+  stats_begin(STAGE_OUTPUT);
+  if (outputFormat != OUTPUT_TEXT) {
+    for (int i = 0; i < *defSize; ++i) {
+      output_record(RECORD_VARIABLE, (*defs)[i].name, (*defs)[i].value);
+    }
+    for (int i = 0; i < *loopSize; ++i) {
+      output_record(RECORD_LOOP, (*loops)[i].name, (*loops)[i].start);
+      output_record(RECORD_INCREMENT, (*loops)[i].name, (*loops)[i].increment);
+      output_record(RECORD_END, (*loops)[i].name, (*loops)[i].end);
+    }
+    stats_end(1);
+    return;
+  }
 
   // Print defs if they exist
   if (*defSize == 0) {
-    printf("There are no variables.\n");
+    output_string("There are no variables.\n");
   } else {
-    printf("Variables:\n");
+    output_string("Variables:\n");
     for (int i = 0; i < *defSize; ++i) {
-      printf(defFormat, (*defs)[i].name, (*defs)[i].value);
+      output_string((*defs)[i].name);
+      output_text(" = ", 3);
+      output_double((*defs)[i].value, sigFigures);
+      output_text("\n", 1);
     }
   }
 
   // Print loops if they exist
   if (*loopSize == 0) {
-    printf("No loop variables were found.\n");
+    output_string("No loop variables were found.\n");
   } else {
-    printf("Loop variables:\n");
+    output_string("Loop variables:\n");
     for (int i = 0; i < *loopSize; ++i) {
-      printf(loopFormat, (*loops)[i].name, (*loops)[i].start, (*loops)[i].start,
-             (*loops)[i].increment, (*loops)[i].end);
+      output_string((*loops)[i].name);
+      output_text(" = ", 3);
+      output_double((*loops)[i].start, sigFigures);
+      output_text(" (", 2);
+      output_double((*loops)[i].start, sigFigures);
+      output_text(", ", 2);
+      output_double((*loops)[i].increment, sigFigures);
+      output_text(", ", 2);
+      output_double((*loops)[i].end, sigFigures);
+      output_text(")\n", 2);
     }
   }
+  stats_end(1);
 }
 
 /**
@@ -1053,7 +7600,8 @@ void variable_print(Def** defs, const int* defSize, Loop** loops,
  * Returns: 0 on successful execution.
  *
  * Errors: If input processing fails, appropriate error messages are printed,
- *and the program may exit.
+ *and the program may exit. If the --state file cannot be loaded or saved,
+ *prints an error and exits with code 21.
  *
  *18/3/25 08:44
  **/
@@ -1070,25 +7618,73 @@ int main(int argc, char* argv[]) {
   // Stores 1 if a readable file is input
   int filePresent = 0;
 
+  // Evaluate bytecode on one thread without statistics unless asked otherwise
+  Options options = {1, 0, BACKEND_BYTECODE, 0, OUTPUT_TEXT, NULL, NULL};
+
   check_validity(argc, argv, &defs, &defSize, &loops, &loopSize, &sigFigures,
-                 &filePresent);
+                 &filePresent, &options);
+
+  // Carry on from the variables of an earlier run, if there was one
+  if (options.state != NULL && access(options.state, F_OK) == 0) {
+    if (state_load(options.state, &defs, &defSize, &loops, &loopSize,
+                   sigFigures) == 0) {
+      fprintf(stderr, stateError, options.state);
+      exit(STATE_CODE);
+    }
+    arena_reset(&lineArena);
+  }
+
+  // A server only returns here in each session it forks
+  if (options.serve != NULL) {
+    serve_handler(options.serve);
+  }
 
-  printf(welcomeMessage);
+  // Only buffer output across lines when nobody is watching it
+  outputInteractive = options.serve != NULL || isatty(STDOUT_FILENO);
+  statsEnabled = options.stats;
+  evalBackend = options.backend;
+  evalJobs = options.jobs;
+  reactiveEnabled = options.reactive;
+  outputFormat = options.output;
+  for (int i = 0; i < options.jobs; ++i) {
+    workers[i].arena.blockSize = CACHE_ARENA_BLOCK_SIZE;
+  }
+
+  if (outputFormat == OUTPUT_BINARY) {
+    output_header();
+  }
+  output_message(welcomeMessage);
   variable_print(&defs, &defSize, &loops, &loopSize, sigFigures);
 
   // Utilise file if present, else process user input
   if (filePresent == 1) {
     file_handler(argv[argc - 1], &defs, &defSize, &loops, &loopSize,
-                 sigFigures);
+                 sigFigures, &options);
   } else {
-    printf(noFileFound);
-    char* line;
-    while ((line = read_line(stdin)) != NULL) {
-      line_handler(line, &defs, &defSize, &loops, &loopSize, sigFigures);
-      free(line);
+    output_message(noFileFound);
+    output_line_done();
+
+    // Lines typed at a terminal are edited before they are sent
+    if (outputFormat == OUTPUT_TEXT && isatty(STDIN_FILENO) &&
+        isatty(STDOUT_FILENO)) {
+      editor_handler(&defs, &defSize, &loops, &loopSize, sigFigures);
+    } else {
+      stream_handler(STDIN_FILENO, &defs, &defSize, &loops, &loopSize,
+                     sigFigures, options.jobs);
     }
   }
-  printf(endMessage);
+  output_message(endMessage);
+  output_flush();
+  if (statsEnabled) {
+    stats_print();
+  }
+
+  // Sessions on a socket share the state they started from but never write it
+  if (options.state != NULL && options.serve == NULL &&
+      state_save(options.state, defs, defSize, loops, loopSize) == 0) {
+    fprintf(stderr, stateError, options.state);
+    return STATE_CODE;
+  }
 
   return 0;
 }